@@ -0,0 +1,207 @@
+/*
+ * Microbenchmark: raw C API vs the C++ front-end in db.hpp.
+ *
+ * Every variant looks up the same keys.  The keys arrive as
+ * std::string_view, which is how our C++ services hold them.
+ *   c-api        db_fetch(): copy the key into std::string for NUL
+ *                termination, then copy the value out of databuf
+ *   c-api-raw    db_fetch() on pre-built C strings, no copies (lower bound)
+ *   db.hpp       Db::get(std::string_view) -> std::optional<std::string_view>
+ *
+ * -z stores the values compressed (hash engine) and reports the ratio
+ * and the time spent in the codec.  The default ~100 byte values are
+ * too short for LZ to find repeats; -v pads each value up to the given
+ * size with a login history array, like the larger records we keep.
+ *
+ * The zipf run looks keys up with a skewed (s=0.99) distribution where
+ * the hottest keys are the oldest ones, i.e. the ones head insertion has
+ * pushed to the end of their chains, and reports hash chain hops per
+ * fetch.  -m turns on chain reordering and adds a run after db_reorder().
+ *
+ * usage: db_bench [-n nkeys] [-r rounds] [-s nshard] [-e hash|log] [-z lz|zlib]
+ *                 [-v valsize] [-m count|mtf|transpose] [dbname]
+ */
+
+#include "db.hpp"
+
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+//统计堆分配次数，用来确认热路径上没有隐藏的分配
+static unsigned long nalloc;
+
+void *operator new(std::size_t n) {
+    ++nalloc;
+    if (void *p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+//生成n个服从zipf分布的排名(0最热)
+static std::vector<int> make_zipf(int nkeys, unsigned long n, double s) {
+    std::vector<double> cdf(nkeys);
+    double sum = 0;
+    for (int i = 0; i < nkeys; i++)
+        cdf[i] = sum += 1.0 / std::pow(i + 1, s);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> u(0, sum);
+    std::vector<int> ranks(n);
+    for (auto &r : ranks)
+        r = std::min<int>(std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin(), nkeys - 1);
+    return ranks;
+}
+
+//第i个键的值：一条用户记录，valsize比它长时追加登录历史，直到接近valsize
+static std::string make_value(int i, size_t valsize) {
+    std::string v = "{\"id\":" + std::to_string(i) + ",\"name\":\"user" + std::to_string(i) +
+                    "\",\"email\":\"user" + std::to_string(i) + "@example.com\",\"active\":true,\"roles\":[\"reader\",\"writer\"]";
+    if (v.size() + 2 < valsize) {
+        v += ",\"history\":[";
+        for (int j = 0;; j++) {
+            std::string ev = std::string(j ? "," : "") + "{\"ts\":" + std::to_string(1700000000 + i * 97 + j * 3607) +
+                             ",\"event\":\"" + (j % 3 ? "login" : "logout") + "\",\"ip\":\"10.0." +
+                             std::to_string(i % 256) + "." + std::to_string(j % 8) + "\"}";
+            if (v.size() + ev.size() + 2 > valsize)
+                break;
+            v += ev;
+        }
+        v += "]";
+    }
+    return v + "}";
+}
+
+template <class F>
+static void run(const char *name, unsigned long nop, F f) {
+    unsigned long before = nalloc;
+    auto t0 = std::chrono::steady_clock::now();
+    size_t sum = f();
+    auto t1 = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+
+    std::printf("%-12s %10.1f ns/op  %6.2f allocs/op  (checksum %zu)\n",
+                name, ns / nop, double(nalloc - before) / nop, sum);
+}
+
+int main(int argc, char *argv[]) {
+    int nkeys = 10000, rounds = 10, ch;
+    DBOPT opt = {1, DB_ENGINE_HASH};
+    const char *name = "db_bench";
+    size_t valsize = 0;
+
+    while ((ch = getopt(argc, argv, "n:r:s:e:z:v:m:")) != -1) {
+        switch (ch) {
+        case 'n': nkeys = std::atoi(optarg); break;
+        case 'r': rounds = std::atoi(optarg); break;
+        case 's': opt.nshard = std::atoi(optarg); break;
+        case 'e': opt.engine = std::strcmp(optarg, "log") == 0 ? DB_ENGINE_LOG : DB_ENGINE_HASH; break;
+        case 'z': opt.flags |= std::strcmp(optarg, "zlib") == 0 ? DB_COMPRESS_ZLIB : DB_COMPRESS; break;
+        case 'v': valsize = std::min<size_t>(std::atoi(optarg), DATLEN_MAX - 1); break;
+        case 'm':
+            opt.flags |= std::strcmp(optarg, "mtf") == 0         ? DB_MTF
+                         : std::strcmp(optarg, "transpose") == 0 ? DB_TRANSPOSE
+                                                                 : DB_REORDER;
+            break;
+        default:
+            std::fprintf(stderr, "usage: db_bench [-n nkeys] [-r rounds] [-s nshard] [-e hash|log] [-z lz|zlib] "
+                                 "[-v valsize] [-m count|mtf|transpose] [dbname]\n");
+            return 1;
+        }
+    }
+    if (optind < argc)
+        name = argv[optind];
+
+    simpledb::Db db(name, O_RDWR | O_CREAT | O_TRUNC, 0644, &opt);
+
+    //键的存储与视图分开，视图模拟调用者手里的std::string_view
+    std::vector<std::string> keys;
+    std::vector<std::string_view> views;
+    keys.reserve(nkeys);
+    for (int i = 0; i < nkeys; i++) {
+        keys.push_back("user-" + std::to_string(i * 7919));
+        db.put(keys.back(), make_value(i, valsize));
+    }
+    for (auto &k : keys)
+        views.emplace_back(k);
+
+    unsigned long nop = (unsigned long)nkeys * rounds;
+    std::printf("%d keys x %d rounds, %d shard(s), %s engine\n", nkeys, rounds,
+                db.stats().nshard, opt.engine == DB_ENGINE_LOG ? "log" : "hash");
+
+    run("c-api", nop, [&] {
+        size_t sum = 0;
+        for (int r = 0; r < rounds; r++)
+            for (auto k : views) {
+                std::string key(k);
+                char *v = db_fetch(db.handle(), key.c_str());
+                std::string val(v);
+                sum += val.size();
+            }
+        return sum;
+    });
+
+    run("c-api-raw", nop, [&] {
+        size_t sum = 0;
+        for (int r = 0; r < rounds; r++)
+            for (auto &k : keys)
+                sum += std::strlen(db_fetch(db.handle(), k.c_str()));
+        return sum;
+    });
+
+    run("db.hpp", nop, [&] {
+        size_t sum = 0;
+        for (int r = 0; r < rounds; r++)
+            for (auto k : views)
+                sum += db.get(k)->size();
+        return sum;
+    });
+
+    run("db.hpp-scan", (unsigned long)nkeys, [&] {
+        size_t sum = 0;
+        for (auto rec : db)
+            sum += rec.key.size() + rec.value.size();
+        return sum;
+    });
+
+    std::vector<int> zipf = make_zipf(nkeys, nop, 0.99);
+    auto zipfrun = [&](const char *name) {
+        DBSTAT before = db.stats();
+        run(name, nop, [&] {
+            size_t sum = 0;
+            for (int i : zipf)
+                sum += db.get(views[i])->size();
+            return sum;
+        });
+        DBSTAT after = db.stats();
+        std::printf("%-12s %10.2f hops/fetch, %lu moved, %lu skipped\n", "",
+                    double(after.fetchhops - before.fetchhops) / (after.fetchok - before.fetchok),
+                    after.moves - before.moves, after.moveskips - before.moveskips);
+    };
+    zipfrun("zipf");
+    if (opt.flags & (DB_REORDER | DB_MTF | DB_TRANSPOSE)) {
+        std::printf("db_reorder: %d chains rewritten\n", db_reorder(db.handle(), -1));
+        zipfrun("zipf-reorder");
+    }
+
+    if (opt.flags & (DB_COMPRESS | DB_COMPRESS_ZLIB)) {
+        DBSTAT st = db.stats();
+        unsigned long nz = st.zstored + st.zskipped;
+        std::printf("compressed %lu/%lu values, ratio %.2f, %.1f ns/compress, %.1f ns/fetch decompressing\n",
+                    st.zstored, nz, st.zbytes ? double(st.zrawbytes) / st.zbytes : 1.0,
+                    nz ? double(st.zcompns) / nz : 0.0, double(st.zdecompns) / (st.fetchok + st.nextrec));
+    }
+
+    return 0;
+}
@@ -1,10 +1,11 @@
-#include "db.h"
+#include "dbint.h"
 #include "apue.h"
 
 #include <fcntl.h>		/* open & db_open flags */
-#include <stdarg.h>
 #include <errno.h>
+#include <limits.h>	/* PATH_MAX */
 #include <sys/uio.h>	/* struct iovec */
+#include <time.h>	/* clock_gettime */
 
 /*
  * Internal index file constants.
@@ -25,21 +26,83 @@
 #define PTR_MAX 9999999	/* max file offset = 10**PTR_SZ - 1 */
 #define NHASH_DEF	 137	/* default hash table size */
 #define FREE_OFF      0	/* free list offset in index file */
-#define HASH_OFF PTR_SZ	/* hash table offset in index file */
+#define IDXTAIL_OFF  PTR_SZ	/* idx append tail ptr offset in index file */
+#define DATTAIL_OFF (2*PTR_SZ)	/* dat extent lock byte; the tail itself is the .dat size */
+#define HASH_OFF    (3*PTR_SZ)	/* hash table offset in index file */
+#define NHDRPTR       3	/* ptrs before the hash table: free, idx tail, dat tail */
+
+/*
+ * Append extents: each process reserves a chunk at the end of
+ * the idx/dat file by bumping the tail under a one-byte lock in the
+ * index header, then appends into its private chunk without any
+ * further locking.  The idx tail is a header pointer (record offsets
+ * must fit in PTR_SZ digits); the dat tail is the size of the .dat
+ * file, because data offsets are stored as plain numbers and are not
+ * limited to PTR_MAX.
+ */
+#define IDXEXT_SZ  4096	/* idx extent size */
+#define DATEXT_SZ 16384	/* dat extent size */
+
+/*
+ * Record compression (DB_COMPRESS): values shorter than ZMIN_LEN are
+ * never compressed, and a compressed value is kept only if it saves
+ * at least 1/ZMIN_SAVE of the raw length.
+ */
+#define ZMIN_LEN     32	/* don't try to compress shorter values */
+#define ZMIN_SAVE     8	/* must save at least 1/8 of the value */
+
+/*
+ * Chain reordering (DB_REORDER): per-handle hit counts, kept in an
+ * open-addressing table keyed by index record offset.  They are
+ * halved after every hdb_reorder() pass so old hotness fades out, and
+ * cleared when the record is deleted or its slot is reused.  Moving
+ * records is not crash-safe, see _db_movehit.
+ */
+#define HOT_SZ     8192	/* hit table slots (power of 2) */
+#define HOT_PROBE     8	/* max probes before giving up on a key */
+
+/*
+ * All record locks are taken on the index file.
+ * With DB_NOLOCK (a replica with a single writer) they are all skipped.
+ */
+#define _db_writew_lock(db, offset, whence, len) \
+	((db)->nolock ? 0 : writew_lock((db)->idxfd, (offset), (whence), (len)))
+#define _db_readw_lock(db, offset, whence, len) \
+	((db)->nolock ? 0 : readw_lock((db)->idxfd, (offset), (whence), (len)))
+#define _db_un_lock(db, offset, whence, len) \
+	((db)->nolock ? 0 : un_lock((db)->idxfd, (offset), (whence), (len)))
 
 typedef unsigned long	DBHASH;	//根据key计算出的hash值
 typedef unsigned long	COUNT;	/* unsigned counter */
 
+//一条索引记录的命中次数
+typedef struct{
+    off_t off;      //索引记录的偏移量，0表示空槽
+    COUNT hits;
+}HOTENT;
+
+//hdb_reorder中链表上的一条记录
+typedef struct{
+    off_t  off;     //索引记录的偏移量
+    off_t  next;    //原来的下一条记录
+    COUNT  hits;
+    size_t pos;     //原来在链表中的位置，保证排序是稳定的
+}CHAINREC;
+
 //DB结构体
 /*
     索引文件结构：
-    | 空闲链表指针 | hash表（由NHASH_DEF个散列链表头指针构成） | \n | 索引记录 | 索引记录 | ... |
+    | 空闲链表指针 | idx尾指针 | dat尾指针 | hash表（由NHASH_DEF个散列链表头指针构成） | \n | 索引记录 | 索引记录 | ... |
+    idx尾指针和dat尾指针指向两个文件中下一个尚未被任何进程预留的位置，两个文件中都可能存在未写入的空洞(全为\0)
     索引记录结构：
-    | 链表指针（指向散列链表下一个元素） | 索引记录长度(占idxlen个字节) | key | 分隔符 | 数据指针 | 分隔符 | 数据记录长度 | \n |
+    | 链表指针（指向散列链表下一个元素） | 索引记录长度(占idxlen个字节) | key | 分隔符 | 数据指针 | 分隔符 | 数据记录长度 | [分隔符 | 压缩编码] | \n |
+    数据记录经过压缩时，索引记录末尾多出分隔符和一个字符的压缩编码(DBZ_LZ/DBZ_ZLIB)，数据记录长度是压缩后的长度，
+    没有压缩的记录保持原来的格式，两种记录可以在同一个文件中共存
 */
-typedef struct{
+typedef struct db{
     int idxfd;  //索引fd
     int datafd;  //文件fd
+    int nolock;  //不使用fcntl记录锁(DB_NOLOCK)
 
     char* idxbuf;  //索引缓冲区,用于暂时的存储读取到的索引记录
     char* databuf; //数据缓冲区，用于暂时的存储读取到的数据
@@ -50,15 +113,33 @@ typedef struct{
     size_t idxlen;  //索引记录的长度
 
     off_t  datoff;  //存储查询到的数据记录的偏移量
-    size_t datlen;  //存储查询到的数据记录的长度
+    size_t datlen;  //存储查询到的数据记录的长度(压缩记录是压缩后的长度)
+    int    datcodec; //数据记录的压缩编码，0表示没有压缩
+    size_t vallen;  //_db_readdat读出的值的长度(解压之后，不包括\0)
+
+    int    compress; //新写入的记录使用的压缩编码，0表示不压缩
+    DBZ   *z;        //压缩编码的状态
+    char  *zbuf;     //压缩数据的缓冲区
+
+    int     reorder; //命中时调整位置的方式：DB_MTF、DB_TRANSPOSE或0
+    HOTENT *hot;     //命中次数表，没有开启DB_REORDER时为NULL
+    size_t  nhot;    //命中次数表中已经使用的槽数
 
     off_t  ptrval;   //索引文件中的指针内容 
     off_t  ptroff;   //存储指向该索引的指针的偏移量
+    off_t  pptroff;  //存储指向前一条索引记录的指针的偏移量(当前记录是链表第一条时无意义)
+    COUNT  hops;     //上一次_db_find_and_lock读取的索引记录数
     off_t  chainoff; //存储当前查询key所在链表的头指针的偏移量
     off_t  hashoff;  //存储第一个哈希桶的偏移量
 
     DBHASH nhash;    //哈希表大小
 
+    //本进程预留的追加区间[ext, extend)，追加写入直接写到ext处，不需要加锁
+    off_t  idxext;
+    off_t  idxextend;
+    off_t  datext;
+    off_t  datextend;
+
     //cnt开头的COUNT类型变量用于记录各种操作的成功和失败次数(因此是可选的)
     COUNT  cnt_delok;    /* delete OK */
     COUNT  cnt_delerr;   /* delete error */
@@ -70,30 +151,50 @@ typedef struct{
     COUNT  cnt_stor3;    /* store: DB_REPLACE, diff len, appended */
     COUNT  cnt_stor4;    /* store: DB_REPLACE, same len, overwrote */
     COUNT  cnt_storerr;  /* store error */
+    COUNT  cnt_zstored;  /* store: written compressed */
+    COUNT  cnt_zskipped; /* store: compression didn't pay off */
+    COUNT  cnt_zrawbytes; /* compressed records: raw bytes */
+    COUNT  cnt_zbytes;   /* compressed records: stored bytes */
+    COUNT  cnt_zcompns;  /* ns spent compressing */
+    COUNT  cnt_zdecompns; /* ns spent decompressing */
+    COUNT  cnt_fetchhops; /* index records read by fetches */
+    COUNT  cnt_moves;    /* fetch hit moved forward */
+    COUNT  cnt_moveskips; /* move skipped, chain busy */
+    COUNT  cnt_reorders; /* chains rewritten by hdb_reorder */
 }DB;
 
 //内部函数
 
 static DB     *_db_alloc(int);
+static off_t   _db_extalloc(DB *, int, off_t, off_t *, off_t *, size_t, size_t);
+static int     _db_extreserve(DB *, int, off_t, off_t *, off_t *, size_t, size_t);
+static int     _db_appendreserve(DB *, int, int);
+static void    _db_extreturn(DB *, int, off_t, off_t *, off_t *);
 static void    _db_dodelete(DB *);
 static int	    _db_find_and_lock(DB *, const char *, int);
-static int     _db_findfree(DB *, int, int);
+static int     _db_findfree(DB *, int, int, int);
 static void    _db_free(DB *);
 static DBHASH  _db_hash(DB *, const char *);
+static int     _db_hotcmp(const void *, const void *);
+static COUNT  *_db_hotslot(DB *, off_t, int);
+static void    _db_movehit(DB *);
+static void    _db_hotclear(DB *, off_t);
 static char   *_db_readdat(DB *);
 static off_t   _db_readidx(DB *, off_t);
 static off_t   _db_readptr(DB *, off_t);
-static void    _db_writedat(DB *, const char *, off_t, int);
+static long    _db_nsec(void);
+static int     _db_skiphole(DB *);
+static void    _db_writedat(DB *, const char *, size_t, int, off_t, int);
 static void    _db_writeidx(DB *, const char *, off_t, int, off_t);
 static void    _db_writeptr(DB *, off_t, off_t);
 
 
 //将idx的文件偏移量移动到索引记录的起始位置(即空闲链表+哈希表字节偏移之后)
-void db_rewind(DBHANDLE h){
+void hdb_rewind(void *h){
     DB		*db = h;
 	off_t	offset;
 
-	offset = (db->nhash + 1) * PTR_SZ;	/* +1 for free list ptr */
+	offset = db->hashoff + db->nhash * PTR_SZ;	/* free list, tail ptrs and hash table */
 
 	/*
 	 * We're just setting the file offset for this process
@@ -123,9 +224,9 @@ static void _db_dodelete(DB *db){
 
     //开始进行删除操作
     //对freelist加锁
-    writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1);
-    //清空数据
-    _db_writedat(db, db->databuf, db->datoff, SEEK_SET);
+    _db_writew_lock(db, FREE_OFF, SEEK_SET, 1);
+    //清空数据，压缩编码保持不变，保证索引记录的长度不变
+    _db_writedat(db, db->databuf, db->datlen - 1, db->datcodec, db->datoff, SEEK_SET);
 
 
     //读取freelist的头指针
@@ -144,24 +245,30 @@ static void _db_dodelete(DB *db){
     _db_writeptr(db,db->ptroff,saveptr);
 
     //解锁freelist
-    un_lock(db->idxfd,FREE_OFF,SEEK_SET,1);
+    _db_un_lock(db,FREE_OFF,SEEK_SET,1);
 
+    _db_hotclear(db,db->idxoff);
 }
 
-static void _db_writedat(DB *db, const char *data, off_t offset, int whence)
+//向dat文件写入一条长度为len的数据记录(压缩数据中可能有\0，因此不能用strlen)，codec是数据的压缩编码
+static void _db_writedat(DB *db, const char *data, size_t len, int codec, off_t offset, int whence)
 {
 	struct iovec	iov[2];
 	static char		newline = NEWLINE;
 
-	//与写入索引文件一样，如果是追加写入，则需要保证lseek和write是原子操作（否则如果有两个进程同时追加，会导致数据错乱）
+	db->datlen = len + 1;	/* datlen includes newline */
+	db->datcodec = codec;
+
+	//与写入索引文件一样，如果是追加写入，则写到本进程预留的追加区间中，区间内的空间只属于本进程，因此不需要对整个文件加锁
     //如果是覆盖写入，则不需要保证原子性,因为findfree函数保证了每个空闲块最多只有一个进程使用，因此不会出现多个进程同时覆盖写入同一个位置的情况
-	if (whence == SEEK_END) /* we're appending, lock entire file */
-		if (writew_lock(db->datafd, 0, SEEK_SET, 0) < 0)
-			err_dump("_db_writedat: writew_lock error"); 
+	if (whence == SEEK_END) { /* we're appending, write into our extent */
+		offset = _db_extalloc(db, db->datafd, DATTAIL_OFF,
+		  &db->datext, &db->datextend, db->datlen, DATEXT_SZ);
+		whence = SEEK_SET;
+	}
 
 	if ((db->datoff = lseek(db->datafd, offset, whence)) == -1)
 		err_dump("_db_writedat: lseek error");
-	db->datlen = strlen(data) + 1;	/* datlen includes newline */
 
 	iov[0].iov_base = (char *) data;
 	iov[0].iov_len  = db->datlen - 1;
@@ -169,10 +276,6 @@ static void _db_writedat(DB *db, const char *data, off_t offset, int whence)
 	iov[1].iov_len  = 1;
 	if (writev(db->datafd, &iov[0], 2) != db->datlen)
 		err_dump("_db_writedat: writev error of data record");
-
-	if (whence == SEEK_END)
-		if (un_lock(db->datafd, 0, SEEK_SET, 0) < 0)
-			err_dump("_db_writedat: un_lock error");
 }
 
 //向idx文件的offset(和whence)处写入一条索引记录，该记录的键为key，下一条索引记录的偏移量为ptrval，dat的偏移量为datoff，dat的长度为datlen
@@ -184,21 +287,26 @@ static void _db_writeidx(DB *db, const char *key,
 	int				len;
 
 	if ((db->ptrval = ptrval) < 0 || ptrval > PTR_MAX)
-		err_quit("_db_writeidx: invalid ptr: %d", ptrval);
-	sprintf(db->idxbuf, "%s%c%lld%c%ld\n", key, SEP,   //%lld是long long int的格式化输出,%ld是long int的格式化输出
-	  (long long)db->datoff, SEP, (long)db->datlen);
+		err_quit("_db_writeidx: invalid ptr: %lld", (long long)ptrval);
+	if (db->datcodec != 0)
+		sprintf(db->idxbuf, "%s%c%lld%c%ld%c%c\n", key, SEP,
+		  (long long)db->datoff, SEP, (long)db->datlen, SEP, db->datcodec);
+	else
+		sprintf(db->idxbuf, "%s%c%lld%c%ld\n", key, SEP,   //%lld是long long int的格式化输出,%ld是long int的格式化输出
+		  (long long)db->datoff, SEP, (long)db->datlen);
 	len = strlen(db->idxbuf);
 	if (len < IDXLEN_MIN || len > IDXLEN_MAX)
 		err_dump("_db_writeidx: invalid length");
 	sprintf(asciiptrlen, "%*lld%*d", PTR_SZ, (long long)ptrval,
 	  IDXLEN_SZ, len);
 
-    //如果是追加，那么lseek和write必须对整个文件加锁，否则会出现多个进程同时写入同一文件的情况
+    //如果是追加，那么写到本进程预留的追加区间中，只有预留新区间时才需要短暂地锁住idx尾指针
     //如果不是追加，那么无需加锁
-	if (whence == SEEK_END)		/* we're appending */
-		if (writew_lock(db->idxfd, ((db->nhash+1)*PTR_SZ)+1,
-		  SEEK_SET, 0) < 0)
-			err_dump("_db_writeidx: writew_lock error");
+	if (whence == SEEK_END) {	/* we're appending */
+		offset = _db_extalloc(db, db->idxfd, IDXTAIL_OFF,
+		  &db->idxext, &db->idxextend, PTR_SZ + IDXLEN_SZ + len, IDXEXT_SZ);
+		whence = SEEK_SET;
+	}
 
 	//这里用lseek来获取当前文件的偏移量
 	if ((db->idxoff = lseek(db->idxfd, offset, whence)) == -1)
@@ -210,11 +318,112 @@ static void _db_writeidx(DB *db, const char *key,
 	iov[1].iov_len  = len;
 	if (writev(db->idxfd, &iov[0], 2) != PTR_SZ + IDXLEN_SZ + len)
 		err_dump("_db_writeidx: writev error of index record");
+}
+
+//保证fd对应文件(idx或dat)的追加区间[*ext, *extend)中至少还有need个字节
+//区间不够时，锁住索引文件头部tailoff处的锁字节，将尾部后移以预留一个新的区间，并用fallocate预先分配磁盘空间
+//idx的尾部是头部的尾指针，dat的尾部就是文件的大小；文件达到上限时返回-1，errno为EFBIG
+static int _db_extreserve(DB *db, int fd, off_t tailoff,
+             off_t *ext, off_t *extend, size_t need, size_t extsz)
+{
+	struct stat	statbuff;
+	off_t	tail;
+	int		err;
+
+	if (*extend - *ext >= need)
+		return(0);
+	if (need > extsz)
+		extsz = need;
+	if (_db_writew_lock(db, tailoff, SEEK_SET, 1) < 0)
+		err_dump("_db_extreserve: writew_lock error");
+	if (tailoff == DATTAIL_OFF) {
+		if (fstat(fd, &statbuff) < 0)
+			err_dump("_db_extreserve: fstat error");
+		tail = statbuff.st_size;
+		//先用ftruncate把文件延长到区间末尾，其他进程据此预留后面的区间
+		if (ftruncate(fd, tail + extsz) < 0) {
+			err = errno;
+			_db_un_lock(db, tailoff, SEEK_SET, 1);
+			errno = err == EINVAL ? EFBIG : err;
+			return(-1);
+		}
+	} else {
+		tail = _db_readptr(db, tailoff);
+		//索引记录的偏移量必须能写进PTR_SZ位，最后一个区间可以短一些
+		if (tail + need > PTR_MAX) {
+			_db_un_lock(db, tailoff, SEEK_SET, 1);
+			errno = EFBIG;
+			return(-1);
+		}
+		if (tail + extsz > PTR_MAX)
+			extsz = PTR_MAX - tail;
+		_db_writeptr(db, tailoff, tail + extsz);
+	}
+	if (_db_un_lock(db, tailoff, SEEK_SET, 1) < 0)
+		err_dump("_db_extreserve: un_lock error");
+
+	//新区间紧接在旧区间之后时直接延长旧区间，否则旧区间剩下的部分成为空洞
+	if (tail != *extend)
+		*ext = tail;
+	*extend = tail + extsz;
+
+	//预分配失败并不影响正确性，后面的write同样会扩展文件
+	if ((err = posix_fallocate(fd, tail, extsz)) != 0 && err != EINVAL &&
+	  err != EOPNOTSUPP && err != EFBIG && err != ENOSPC)
+		err_dump("_db_extreserve: posix_fallocate error");
+	return(0);
+}
+
+//从追加区间中分配need个字节，返回分配到的偏移量
+//hdb_store在修改任何内容之前已经用_db_extreserve预留了空间，这里不会再失败
+static off_t _db_extalloc(DB *db, int fd, off_t tailoff,
+             off_t *ext, off_t *extend, size_t need, size_t extsz)
+{
+	off_t	off;
 
-	if (whence == SEEK_END)
-		if (un_lock(db->idxfd, ((db->nhash+1)*PTR_SZ)+1,
-		  SEEK_SET, 0) < 0)
-			err_dump("_db_writeidx: un_lock error");
+	if (_db_extreserve(db, fd, tailoff, ext, extend, need, extsz) < 0)
+		err_dump("_db_extalloc: no space reserved");
+	off = *ext;
+	*ext += need;
+	return(off);
+}
+
+//追加一条键长keylen、数据长datlen(含换行符)的记录之前预留idx和dat的空间，文件达到上限时返回-1
+//索引记录中数据偏移量的位数这时还不知道，按最长的20位估计
+static int _db_appendreserve(DB *db, int keylen, int datlen)
+{
+	size_t	idxlen = PTR_SZ + IDXLEN_SZ + keylen + 1 + 20 + 1 + IDXLEN_SZ + 2 + 1;
+
+	if (_db_extreserve(db, db->idxfd, IDXTAIL_OFF, &db->idxext, &db->idxextend,
+	  idxlen, IDXEXT_SZ) < 0)
+		return(-1);
+	return(_db_extreserve(db, db->datafd, DATTAIL_OFF, &db->datext, &db->datextend,
+	  datlen, DATEXT_SZ));
+}
+
+//关闭时归还本进程追加区间中没有用到的部分
+//只有这个区间仍然位于文件末尾时(尾指针没有被其他进程移动过)才能归还，否则这部分空间会作为空洞保留下来
+static void _db_extreturn(DB *db, int fd, off_t tailoff, off_t *ext, off_t *extend)
+{
+	struct stat	statbuff;
+
+	if (*extend <= *ext)
+		return;
+	if (_db_writew_lock(db, tailoff, SEEK_SET, 1) < 0)
+		err_dump("_db_extreturn: writew_lock error");
+	if (tailoff == DATTAIL_OFF) {
+		if (fstat(fd, &statbuff) < 0)
+			err_dump("_db_extreturn: fstat error");
+		if (statbuff.st_size == *extend && ftruncate(fd, *ext) < 0)
+			err_dump("_db_extreturn: ftruncate error");
+	} else if (_db_readptr(db, tailoff) == *extend) {
+		_db_writeptr(db, tailoff, *ext);
+		if (ftruncate(fd, *ext) < 0)
+			err_dump("_db_extreturn: ftruncate error");
+	}
+	if (_db_un_lock(db, tailoff, SEEK_SET, 1) < 0)
+		err_dump("_db_extreturn: un_lock error");
+	*ext = *extend = 0;
 }
 
 //将一个ptrval值写入索引文件的ptrval指针处
@@ -223,7 +432,7 @@ static void _db_writeptr(DB *db, off_t offset, off_t ptrval)
 	char	asciiptr[PTR_SZ + 1];
 
 	if (ptrval < 0 || ptrval > PTR_MAX)
-		err_quit("_db_writeptr: invalid ptr: %d", ptrval);
+		err_quit("_db_writeptr: invalid ptr: %lld", (long long)ptrval);
 	sprintf(asciiptr, "%*lld", PTR_SZ, (long long)ptrval);
 
 	if (lseek(db->idxfd, offset, SEEK_SET) == -1)
@@ -233,12 +442,13 @@ static void _db_writeptr(DB *db, off_t offset, off_t ptrval)
 }
 
 //从空闲链表中找到一个key size和data size均满足的空闲空间
-static int  _db_findfree(DB *db, int keylen, int datlen){
+//是否压缩也必须一致，这样新的索引记录(可能带有压缩编码)与原来的长度相同
+static int  _db_findfree(DB *db, int keylen, int datlen, int codec){
     int rc;
     off_t offset, nextoffset, saveoffset;
 
     //首先对空闲链表加锁
-    if(writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) err_dump("_db_findfree: writew_lock error");
+    if(_db_writew_lock(db, FREE_OFF, SEEK_SET, 1) < 0) err_dump("_db_findfree: writew_lock error");
 
     //saveoffset存储空闲链表中的指针偏移量,可以看作是指针的指针，指针的地址
     saveoffset = FREE_OFF;
@@ -254,7 +464,8 @@ static int  _db_findfree(DB *db, int keylen, int datlen){
         //注意在_db_readidx中，offset处索引记录记录的包括idxoff,datoff在内的信息会被存储到db中
 
         //如果空闲空间的key size和data size均满足要求，则返回空闲空间的偏移量
-        if(strlen(db->idxbuf) == keylen && db->datlen == datlen) break;
+        if(strlen(db->idxbuf) == keylen && db->datlen == datlen &&
+          (db->datcodec != 0) == (codec != 0)) break;
 
         //否则，继续遍历空闲链表
         saveoffset = offset;
@@ -267,24 +478,36 @@ static int  _db_findfree(DB *db, int keylen, int datlen){
     }else{
         //当前找到的空间是offset指向的空间，指向这个空间的指针存储在saveoffset中
         _db_writeptr(db,saveoffset,db->ptrval);
+        _db_hotclear(db,offset);
         rc = 0;
     }
 
     //解锁空闲链表
-    un_lock(db->idxfd,FREE_OFF,SEEK_SET,1);
+    _db_un_lock(db,FREE_OFF,SEEK_SET,1);
     return (rc);
 
 }
 
 //从数据文件中,datoff偏移量处，读取datlen长度的数据到datbuf缓冲区
+//压缩的记录先读到zbuf中，再解压到databuf，值的长度保存在vallen中
 static char* _db_readdat(DB *db){
+    char *buf = db->datcodec!=0 ? db->zbuf : db->databuf;
+    long t;
+
     lseek(db->datafd,db->datoff,SEEK_SET);
-    read(db->datafd,db->databuf,db->datlen);
-    if(db->databuf[db->datlen-1] != NEWLINE){
+    read(db->datafd,buf,db->datlen);
+    if(buf[db->datlen-1] != NEWLINE){
         err_dump("_db_readdat: missing newline");
+    }
+    if(db->datcodec==0){
+        db->vallen = db->datlen-1;
     }else{
-        db->databuf[db->datlen-1] = 0;
+        t = _db_nsec();
+        db->vallen = dbz_decompress(db->z,db->datcodec,buf,db->datlen-1,db->databuf,DATLEN_MAX-1);
+        if(db->vallen==0) err_dump("_db_readdat: can't decompress data record (codec %c)",db->datcodec);
+        db->cnt_zdecompns += _db_nsec()-t;
     }
+    db->databuf[db->vallen] = 0;
     return db->databuf;
 }
 
@@ -293,21 +516,24 @@ static char* _db_readdat(DB *db){
 //将索引记录的偏移量记录在idxoff中
 //填充的内容包括：idxbuf,datoff,datlen,idxoff
 //offset是这条索引记录在idx文件中的偏移量
+//offset为0时表示从当前文件偏移量处顺序读取(供db_nextrec使用)，此时读到文件末尾返回-1
 static off_t   _db_readidx(DB *db, off_t offset){
 
     //首先读取下一条索引记录的偏移量以及索引记录的长度(定长部分)
     char asciiptr[PTR_SZ+1];
     char recordlen[IDXLEN_SZ+1];
     struct iovec iov[2];
+    ssize_t i;
     if((db->idxoff = lseek(db->idxfd,offset,offset==0?SEEK_CUR:SEEK_SET))==-1){
         err_dump("_db_readidx:lseek error");
-    } 
+    }
     iov[0].iov_base = asciiptr;
     iov[0].iov_len = PTR_SZ;
     iov[1].iov_base = recordlen;
     iov[1].iov_len = IDXLEN_SZ;
 
-    if(readv(db->idxfd,iov,2)!=PTR_SZ+IDXLEN_SZ){
+    if((i = readv(db->idxfd,iov,2))!=PTR_SZ+IDXLEN_SZ){
+        if(i==0 && offset==0) return(-1);  //顺序读取时到达文件末尾
         err_dump("_db_readidx:readv error");
     }
 
@@ -331,7 +557,7 @@ static off_t   _db_readidx(DB *db, off_t offset){
     }
 
     //读取键、数据记录的偏移量以及数据记录的长度
-    char *ptr1,*ptr2;
+    char *ptr1,*ptr2,*ptr3;
     if((ptr1 = strchr(db->idxbuf,SEP))==NULL){
         err_dump("_db_readidx:missing first separator");
     }
@@ -343,6 +569,14 @@ static off_t   _db_readidx(DB *db, off_t offset){
 
     *ptr2++ = 0;
 
+    //可选的第三个分隔符之后是压缩编码
+    if((ptr3 = strchr(ptr2,SEP))!=NULL){
+        *ptr3++ = 0;
+        db->datcodec = *ptr3;
+    }else{
+        db->datcodec = 0;
+    }
+
     //将两个分割符都替换成\0,方便直接读取，现在idxbuf中的内容是： key内容\0 + 数据记录偏移量\0 + 数据长度\0
     //想要得到key，直接对idxbuf进行read即可
     //想要得到数据记录的偏移量，对ptr1进行read即可
@@ -368,6 +602,91 @@ static off_t  _db_readptr(DB *db, off_t offset){
     return atol(asciiptr);
 }
 
+//跳过idx文件当前偏移量处的空洞(预留了但是没有写入的追加区间，内容全为\0)
+//返回-1表示已经到达文件末尾
+static int _db_skiphole(DB *db){
+    char buf[512];
+    off_t pos;
+    ssize_t n, i;
+
+    if((pos = lseek(db->idxfd,0,SEEK_CUR))==-1) err_dump("_db_skiphole:lseek error");
+    for(;;){
+        if((n = pread(db->idxfd,buf,sizeof(buf),pos))<0) err_dump("_db_skiphole:pread error");
+        if(n==0) return(-1);
+        for(i=0;i<n && buf[i]==0;i++);
+        pos += i;
+        if(i<n) break;
+    }
+    if(lseek(db->idxfd,pos,SEEK_SET)==-1) err_dump("_db_skiphole:lseek error");
+    return(0);
+}
+
+//单调时钟的纳秒数，用于统计压缩和解压的耗时
+static long _db_nsec(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000L+ts.tv_nsec;
+}
+
+//在命中次数表中查找索引记录off的计数，create不为0时找不到就插入一个新的槽
+//表已经太满或者探测次数用完时返回NULL，这条记录的命中不会被统计
+static COUNT *_db_hotslot(DB *db, off_t off, int create){
+    size_t i, n;
+
+    i = (((unsigned long)off * 2654435761UL) >> 8) & (HOT_SZ-1);
+    for(n=0;n<HOT_PROBE;n++,i=(i+1)&(HOT_SZ-1)){
+        if(db->hot[i].off==off) return &db->hot[i].hits;
+        if(db->hot[i].off==0){
+            if(!create || db->nhot>=HOT_SZ/4*3) return NULL;
+            db->hot[i].off = off;
+            db->hot[i].hits = 0;
+            db->nhot++;
+            return &db->hot[i].hits;
+        }
+    }
+    return NULL;
+}
+
+//索引记录off被删除或者它的空间被另一个键重用时清除它的命中次数，否则新的键会继承旧键的热度
+//只把计数清零而不腾出槽位，避免打断线性探测；计数为0的槽在下一次hdb_reorder时被丢弃
+//命中次数表属于句柄，其他进程的删除不会清除这里的计数，最多让一次重排的顺序不够准确
+static void _db_hotclear(DB *db, off_t off){
+    COUNT *hits;
+
+    if(db->hot!=NULL && (hits = _db_hotslot(db,off,0))!=NULL) *hits = 0;
+}
+
+//fetch命中了一条不在链表头部的记录，调用者持有这条链表的读锁
+//以非阻塞的方式把读锁升级为写锁(其他进程也在读这条链表时会失败，此时放弃这次移动)，
+//成功后把记录移到链表头部(DB_MTF)或者与前一条记录交换(DB_TRANSPOSE)，升级后的写锁由调用者最后的解锁一起释放
+//
+//在单向链表中移动一条记录需要写好几个指针，不论按什么顺序写，第一次写都会摘下一条记录或者形成一个环，
+//因此三次写指针之间进程被杀死会让被摘下的记录从链表中丢失(db_nextrec仍然能找到它们，但fetch找不到)。
+//hdb_reorder的重新链接也是一样。所以DB_MTF、DB_TRANSPOSE和db_reorder()都需要显式开启，
+//只应该用在可以重建的数据上，例如缓存或者follower维护的副本
+static void _db_movehit(DB *db){
+    off_t head;
+
+    if(!db->nolock && write_lock(db->idxfd,db->chainoff,SEEK_SET,1)<0){
+        db->cnt_moveskips++;
+        return;
+    }
+    if(db->reorder==DB_TRANSPOSE){
+        //... -> P -> R -> next 变为 ... -> R -> P -> next，P的偏移量就是ptroff
+        _db_writeptr(db,db->pptroff,db->idxoff);
+        _db_writeptr(db,db->idxoff,db->ptroff);
+        _db_writeptr(db,db->ptroff,db->ptrval);
+    }else{
+        //先从原来的位置摘下，再用头插法插回链表头部
+        head = _db_readptr(db,db->chainoff);
+        _db_writeptr(db,db->ptroff,db->ptrval);
+        _db_writeptr(db,db->idxoff,head);
+        _db_writeptr(db,db->chainoff,db->idxoff);
+    }
+    db->cnt_moves++;
+}
+
 //根据键值计算hash值
 static DBHASH  _db_hash(DB *db, const char *key){
     DBHASH hval = 0;
@@ -391,6 +710,10 @@ static DB* _db_alloc(int namelen){
     db->idxfd = -1;
     db->datafd = -1;
 
+    //还没有预留任何追加区间
+    db->idxext = db->idxextend = 0;
+    db->datext = db->datextend = 0;
+
     //分配DB名称内存
     db->name = malloc(namelen+5);
     if(db->name==NULL) err_dump("db name malloc error");
@@ -400,6 +723,11 @@ static DB* _db_alloc(int namelen){
     if(db->idxbuf==NULL) err_dump("db idxbuf malloc error");
     db->databuf = malloc(DATLEN_MAX+2);
     if(db->databuf==NULL) err_dump("db databuf malloc error");
+    db->hot = NULL;     //打开时根据DB_REORDER分配
+    //不论是否开启压缩，都可能读到其他进程写入的压缩记录
+    db->zbuf = malloc(DATLEN_MAX+2);
+    if(db->zbuf==NULL) err_dump("db zbuf malloc error");
+    db->z = dbz_alloc();
 
     return db;
 }
@@ -413,58 +741,67 @@ static void _db_free(DB *db){
 		free(db->idxbuf);
 	if (db->databuf != NULL)
 		free(db->databuf);
+	if (db->zbuf != NULL)
+		free(db->zbuf);
+	if (db->hot != NULL)
+		free(db->hot);
+	dbz_free(db->z);
 	if (db->name != NULL)
 		free(db->name);
 	free(db);
 }
 
-void db_close(DBHANDLE h){
-    _db_free(h);
+void hdb_close(void *h){
+    DB *db = h;
+
+    _db_extreturn(db, db->idxfd, IDXTAIL_OFF, &db->idxext, &db->idxextend);
+    _db_extreturn(db, db->datafd, DATTAIL_OFF, &db->datext, &db->datextend);
+    _db_free(db);
 }
 
-//打开一个数据库，其参数与系统调用open相同
-DBHANDLE db_open(const char* pathname,int flags,...){
+//打开一个分片的idx/dat文件对，flags和mode的含义与系统调用open相同
+//pathname不带后缀，分别加上.idx和.dat作为索引文件和数据文件
+void *hdb_open(const char* pathname,int flags,int mode,const DBOPT *opt){
     DB			*db;
-	int			len, mode;
+	int			len;
 	size_t		i;
 	char		asciiptr[PTR_SZ + 1],
-				hash[(NHASH_DEF + 1) * PTR_SZ + 2];  /*散列表,每个元素占PTR_SZ个字节，最后两个字节用于存储换行符和空字符*/
+				hash[(NHASH_DEF + NHDRPTR) * PTR_SZ + 2];  /*散列表,每个元素占PTR_SZ个字节，最后两个字节用于存储换行符和空字符*/
 					/* +2 for newline and null */
 	struct stat	statbuff;
 
     len = strlen(pathname);
 
     //分配DB所需空间(这里不包括索引和数据文件)
-    db = _db_alloc(strlen(pathname));
+    db = _db_alloc(len);
     if(db==NULL) err_dump("db_open malloc error");
 
+    db->nolock = opt!=NULL && (opt->flags & DB_NOLOCK);
+    //DB_COMPRESS_ZLIB在没有zlib时退回到内置的LZ
+    db->compress = 0;
+    if(opt!=NULL && (opt->flags & DB_COMPRESS_ZLIB) && dbz_available(DBZ_ZLIB)) db->compress = DBZ_ZLIB;
+    else if(opt!=NULL && (opt->flags & (DB_COMPRESS|DB_COMPRESS_ZLIB))) db->compress = DBZ_LZ;
+    //调整链表顺序需要写索引文件，只读打开时忽略
+    db->reorder = 0;
+    db->nhot = 0;
+    if(opt!=NULL && (opt->flags & (DB_REORDER|DB_MTF|DB_TRANSPOSE)) && (flags & O_ACCMODE)!=O_RDONLY){
+        if((db->hot = calloc(HOT_SZ,sizeof(HOTENT)))==NULL) err_dump("db_open calloc error");
+        if(opt->flags & DB_TRANSPOSE) db->reorder = DB_TRANSPOSE;
+        else if(opt->flags & DB_MTF) db->reorder = DB_MTF;
+    }
+
     //分配db的哈希表结构
     db->nhash = NHASH_DEF;
     db->hashoff = HASH_OFF;
 
     //分配db名称
-    db->name = strcpy(db->name,pathname);
-    db->name = strcat(db->name,".idx");  //准备用于创建索引文件
+    strcpy(db->name,pathname);
+    strcat(db->name,".idx");  //准备用于创建索引文件
 
-    //创建数据库
-    if(flags & O_CREAT){
-        //创建数据库，我们需要取得第三个权限参数（varargs）
-        va_list ap;
-        va_start(ap,flags);
-        mode = va_arg(ap,mode_t);
-        va_end(ap);
-
-        //创建索引和数据文件
-        db->idxfd = open(db->name,flags,mode);
-        strcpy(db->name+len,".dat");  //strcpy的作用是将dst拷贝(如果src原本有内容则覆盖)到src指针所指向的位置
-        db->datafd = open(db->name,flags,mode);
-    }
-    else{
-        //否则就是正常的打开数据库
-        db->idxfd = open(db->name,flags);
-        db->name = strcpy(db->name+len,".dat");
-        db->datafd = open(db->name,flags);
-    }
+    //创建索引和数据文件(不带O_CREAT时mode会被open忽略)
+    db->idxfd = open(db->name,flags,mode);
+    strcpy(db->name+len,".dat");  //strcpy的作用是将dst拷贝(如果src原本有内容则覆盖)到src指针所指向的位置
+    db->datafd = open(db->name,flags,mode);
 
     //fd打开失败
     if(db->datafd<0 || db->idxfd<0){
@@ -473,23 +810,27 @@ DBHANDLE db_open(const char* pathname,int flags,...){
     }
 
     //如果是创建新的数据库，或者对原本的数据库进行格式化，那么我们必须要对数据库的索引文件指针进行初始化操作
-    if(flags & (O_CREAT | O_TRUNC)==(O_CREAT|O_TRUNC)){
+    if(flags & O_CREAT){
         //初始化时，必须对idx文件进行加锁，防止丢失其他进程对数据库的修改
-        if(writew_lock(db->idxfd,0,SEEK_SET,0)<0) err_dump("db_open writew_lock error");   //加锁需要调用fcntl函数，参考书中392 fcntl(int fd,int cmd(F_SETLK),flock*)
+        if(_db_writew_lock(db,0,SEEK_SET,0)<0) err_dump("db_open writew_lock error");   //加锁需要调用fcntl函数，参考书中392 fcntl(int fd,int cmd(F_SETLK),flock*)
         //其中flock* 主要包含 l_type(锁类型) l_whence(偏移量) l_start(起始位置) l_len(加锁长度) l_pid(进程id，无需填写，用于F_GETLK cmd的返回值)
 
-        //查看索引文件的状态
-        struct stat* statbuff;
-        if(fstat(db->idxfd,statbuff)<0) err_dump("db_open fstat error");
+        //查看索引文件的状态，只有空文件才需要初始化(可能有其他进程已经完成了初始化)
+        if(fstat(db->idxfd,&statbuff)<0) err_dump("db_open fstat error");
 
-        if(statbuff->st_size==0){
+        if(statbuff.st_size==0){
             //首先创建一个0的ASCII编码，在本项目中，所有指针都用ASCII偏移量来表示，而0代表了空指针
             //%*d表示输出的宽度为PTR_SZ，不足的用空格填充
             sprintf(asciiptr,"%*d",PTR_SZ,0);
-            //初始化空闲链表指针和哈希表指针，在一个idx数据中，共有哈希表指针NHASH_DEF个，空闲链表指针1个，一共NHASH_DEF+1个指针，每个指针占PTR_SZ个字节
+            //初始化头部指针，在一个idx数据中，共有空闲链表指针1个，尾指针2个，哈希表指针NHASH_DEF个，一共NHASH_DEF+NHDRPTR个指针，每个指针占PTR_SZ个字节
+            //idx尾指针初始指向头部之后(第一条索引记录的位置)，dat尾指针初始为0，其余指针都是空指针
             hash[0] = 0; //先添加一个终止符，用于后面的strcat
-            for(i=0;i<NHASH_DEF+1;i++){
-                strcat(hash,asciiptr);
+            for(i=0;i<NHASH_DEF+NHDRPTR;i++){
+                if(i*PTR_SZ==IDXTAIL_OFF){
+                    sprintf(hash+strlen(hash),"%*d",PTR_SZ,(NHASH_DEF+NHDRPTR)*PTR_SZ+1);
+                }else{
+                    strcat(hash,asciiptr);
+                }
             }
             //指针区域和索引记录区域用一个换行符分隔
             strcat(hash,"\n");  //添加换行符
@@ -498,10 +839,12 @@ DBHANDLE db_open(const char* pathname,int flags,...){
             if(write(db->idxfd,hash,strlen(hash))!=strlen(hash)) err_dump("db_open write error");
         }
         //完成对指针的初始化后，需要关闭锁
-        if(un_lock(db->idxfd,0,SEEK_SET,0)<0) err_dump("db_open un_lock error");   //解锁同样是调用fcntl函数实现，cmd为F_SETLK，l_type为F_UNLCK
+        if(_db_un_lock(db,0,SEEK_SET,0)<0) err_dump("db_open un_lock error");   //解锁同样是调用fcntl函数实现，cmd为F_SETLK，l_type为F_UNLCK
     }
 
+    db->cnt_delok = 0;
     db->cnt_delerr = 0;
+    db->cnt_fetchok = 0;
     db->cnt_fetcherr = 0;
     db->cnt_nextrec = 0;
     db->cnt_stor1 = 0;
@@ -509,29 +852,45 @@ DBHANDLE db_open(const char* pathname,int flags,...){
     db->cnt_stor3 = 0;
     db->cnt_stor4 = 0;
     db->cnt_storerr = 0;
-
-
-    db_rewind(db);  //将索引文件指针指向第一个记录
+    db->cnt_zstored = 0;
+    db->cnt_zskipped = 0;
+    db->cnt_zrawbytes = 0;
+    db->cnt_zbytes = 0;
+    db->cnt_zcompns = 0;
+    db->cnt_zdecompns = 0;
+    db->cnt_fetchhops = 0;
+    db->cnt_moves = 0;
+    db->cnt_moveskips = 0;
+    db->cnt_reorders = 0;
+
+
+    hdb_rewind(db);  //将索引文件指针指向第一个记录
     return(db);
 }
 
-//从指定的数据库中读取一条记录
-char* db_fetch(DBHANDLE h, const char *key){
-    DB *db = (DB*) h;
+//从指定的数据库中读取一条记录，datlen不为NULL时返回数据的长度(不包括结尾的\0)
+char* hdb_fetch(void *h, const char *key, size_t *datlen){
+    DB *db = h;
     char* ptr;
+    COUNT *hits;
 
     //调用_db_find_and_lock函数，对指定的key查找并且加锁
-    int res = _db_find_and_lock(h,key,0);
+    int res = _db_find_and_lock(db,key,0);
     if(res<0){
         //没有找到指定记录
         ptr = NULL;
         db->cnt_fetcherr += 1;  
     }else{
         ptr = _db_readdat(db);
+        if(datlen!=NULL) *datlen = db->vallen;
         db->cnt_fetchok += 1;
+        //记录命中次数，并且在可以不等待地拿到写锁时把记录往链表前面移动
+        if(db->hot!=NULL && (hits = _db_hotslot(db,db->idxoff,1))!=NULL) (*hits)++;
+        if(db->reorder!=0 && db->ptroff!=db->chainoff) _db_movehit(db);
     }
+    db->cnt_fetchhops += db->hops;
     //解锁
-    if(un_lock(db->idxfd,db->chainoff,SEEK_SET,1)<0) err_dump("db_fetch un_lock error");
+    if(_db_un_lock(db,db->chainoff,SEEK_SET,1)<0) err_dump("db_fetch un_lock error");
     return ptr;
 }
 
@@ -542,15 +901,16 @@ static int _db_find_and_lock(DB *db, const char *key, int writelock){
     //计算hash值
     db->chainoff = (_db_hash(db,key)*PTR_SZ)+db->hashoff;
     db->ptroff = db->chainoff;
+    db->hops = 0;
 
     //对所在的链表加锁,这里采用细粒度的锁，即对某个hash链表的第一个字节加上记录锁，而不是整个文件加锁
     //同时，这里采用的是阻塞式的锁，如果不能获取到锁，则进程会一直阻塞
     if(writelock){
-        if(writew_lock(db->idxfd,db->chainoff,SEEK_SET,1)<0){
+        if(_db_writew_lock(db,db->chainoff,SEEK_SET,1)<0){
             err_dump("_db_find_and_lock:write_lock_error");
         }
     }else{
-        if(readw_lock(db->idxfd,db->chainoff,SEEK_SET,1)<0){
+        if(_db_readw_lock(db,db->chainoff,SEEK_SET,1)<0){
             err_dump("_db_find_and_lock:readw_lock_error");
         }
     }
@@ -560,17 +920,22 @@ static int _db_find_and_lock(DB *db, const char *key, int writelock){
     while(offset!=0){
         //读取offset指向的索引记录
         nextoffset = _db_readidx(db,offset);
+        db->hops++;
         if(strcmp(db->idxbuf,key)==0) break; //找到了
+        db->pptroff = db->ptroff;
         db->ptroff = offset;
         offset = nextoffset;
     }
     return offset==0?-1:0;
 }
 
-int db_store(DBHANDLE db, const char *key, const char *data, int flag){
-    DB *h = (DB*)db;
-    int rc;
+int hdb_store(void *db, const char *key, const char *data, int flag){
+    DB *h = db;
+    int rc, codec = 0;
     off_t ptrval;
+    const char *sdata = data;   //实际写入dat文件的内容(可能是压缩后的)
+    size_t n;
+    long t;
     //首先判断flag是否有效
     if(flag!=DB_INSERT && flag!=DB_REPLACE && flag!=DB_STORE){
         errno = EINVAL;
@@ -579,8 +944,31 @@ int db_store(DBHANDLE db, const char *key, const char *data, int flag){
 
     int keylen = strlen(key);
     int datlen = strlen(data)+1;    //+1是为了存储换行符
-    if(datlen<DATLEN_MIN || datlen>DATLEN_MAX){
-        err_dump("db_store:invalid data length");
+    //非法的参数只返回错误，不能让调用者(例如服务进程)因为一次错误的请求而退出
+    //键中不能出现分隔符和换行符，并且整条索引记录(键:偏移量:长度\n)不能超过IDXLEN_MAX
+    if(datlen<DATLEN_MIN || datlen>DATLEN_MAX || keylen==0 ||
+      keylen+PTR_SZ+IDXLEN_SZ+3>IDXLEN_MAX || strchr(key,SEP)!=NULL || strchr(key,NEWLINE)!=NULL){
+        errno = EINVAL;
+        h->cnt_storerr++;
+        return -1;
+    }
+
+    //在加锁之前压缩，压缩后至少要节省1/ZMIN_SAVE，否则按原样存储
+    //压缩记录的索引记录多出两个字节(分隔符和压缩编码)，不能因此超过IDXLEN_MAX
+    if(h->compress!=0 && datlen-1>=ZMIN_LEN && keylen+PTR_SZ+IDXLEN_SZ+5<=IDXLEN_MAX){
+        t = _db_nsec();
+        n = dbz_compress(h->z,h->compress,data,datlen-1,h->zbuf,(datlen-1)-(datlen-1)/ZMIN_SAVE);
+        h->cnt_zcompns += _db_nsec()-t;
+        if(n>0){
+            h->cnt_zstored++;
+            h->cnt_zrawbytes += datlen-1;
+            h->cnt_zbytes += n;
+            sdata = h->zbuf;
+            codec = h->compress;
+            datlen = n+1;
+        }else{
+            h->cnt_zskipped++;
+        }
     }
 
     //检查key是否已经存在
@@ -589,8 +977,9 @@ int db_store(DBHANDLE db, const char *key, const char *data, int flag){
         //不存在
         if(flag==DB_REPLACE){
             //如果是替换，则返回错误
-            if(un_lock(h->idxfd,h->chainoff,SEEK_SET,1)<0) err_dump("db_store un_lock error");
+            if(_db_un_lock(h,h->chainoff,SEEK_SET,1)<0) err_dump("db_store un_lock error");
             errno = ENOENT;
+            h->cnt_storerr++;
             return -1;
         }else{
             //否则是插入，需要将key和data写入索引文件和数据文件
@@ -598,49 +987,231 @@ int db_store(DBHANDLE db, const char *key, const char *data, int flag){
             //可以看出，插入使用的是头插法
             ptrval = _db_readptr(h,h->chainoff);
             //首先尝试是否能够重用空闲链表
-            if(_db_findfree(h,keylen,datlen)<0){      
+            if(_db_findfree(h,keylen,datlen,codec)<0){      
                 //不能重用，需要将数据追加到数据文件和索引文件的尾部
+                //先预留空间，文件达到上限时在修改任何内容之前失败
+                if(_db_appendreserve(h,keylen,datlen)<0) goto errout;
 
                 //注意三个write的顺序不能颠倒，在writedat中会首先向dat文件追加数据，然后将数据的长度和偏移量保存在datlen和datoffset中
                 //之后再writeidx中会将索引记录的偏移量保存在idxoff中
-                _db_writedat(h,data,h->datoff,SEEK_END);
-                _db_writeidx(h,key,h->idxoff,SEEK_END,ptrval); //头插法，将新的索引记录插入到链表的头部，原本的第一条记录的偏移量作为新记录的next指针
+                _db_writedat(h,sdata,datlen-1,codec,0,SEEK_END);
+                _db_writeidx(h,key,0,SEEK_END,ptrval); //头插法，将新的索引记录插入到链表的头部，原本的第一条记录的偏移量作为新记录的next指针
                 _db_writeptr(h,h->chainoff,h->idxoff);       //头插法,将哈希桶的头指针指向新插入的索引记录
                 h->cnt_stor1++;
-                return 1;
+                rc = 1;
             }else{
                 //可以重用，此时直接将内容写入findfree中找到的idxoff和datoff
-                _db_writedat(h, data, h->datoff, SEEK_SET);
+                _db_writedat(h, sdata, datlen-1, codec, h->datoff, SEEK_SET);
                 _db_writeidx(h, key, h->idxoff, SEEK_SET, ptrval);
                 _db_writeptr(h, h->chainoff, h->idxoff);
                 h->cnt_stor2++;
-                return 1;
+                rc = 1;
             }
         }
     }else{
         //存在
         if(flag==DB_INSERT){
             //如果是插入，则返回错误
-            if(un_lock(h->idxfd,h->chainoff,SEEK_SET,1)<0) err_dump("db_store un_lock error");
+            if(_db_un_lock(h,h->chainoff,SEEK_SET,1)<0) err_dump("db_store un_lock error");
             errno = EEXIST;
+            h->cnt_storerr++;
             return -1;
         }else{
             //否则是替换，需要将数据写入数据文件
-            if(datlen==h->datlen){
-                //如果长度一致，那么直接覆盖
-                _db_writedat(h,data,h->datoff,SEEK_SET);
+            if(datlen==h->datlen && codec==h->datcodec){
+                //如果长度和压缩编码都一致，那么直接覆盖，索引记录不需要修改
+                _db_writedat(h,sdata,datlen-1,codec,h->datoff,SEEK_SET);
                 h->cnt_stor3++;
-                return 1;
+                rc = 1;
             }else{
                 //如果长度不一致，那么需要将数据追加到数据文件的尾部
+                if(_db_appendreserve(h,keylen,datlen)<0) goto errout;
                 _db_dodelete(h);	
                 ptrval = _db_readptr(h, h->chainoff);
-                _db_writedat(h, data, 0, SEEK_END);
+                _db_writedat(h, sdata, datlen-1, codec, 0, SEEK_END);
                 _db_writeidx(h, key, 0, SEEK_END, ptrval);
                 _db_writeptr(h, h->chainoff, h->idxoff);
                 h->cnt_stor4++;
-                return 1;
+                rc = 1;
             }
         }
     }
-}
\ No newline at end of file
+    //写入完成，释放_db_find_and_lock中对哈希链表加的写锁
+    if(_db_un_lock(h,h->chainoff,SEEK_SET,1)<0) err_dump("db_store un_lock error");
+    return rc;
+
+errout:
+    rc = errno;
+    if(_db_un_lock(h,h->chainoff,SEEK_SET,1)<0) err_dump("db_store un_lock error");
+    errno = rc;
+    h->cnt_storerr++;
+    return -1;
+}
+
+//删除一条记录
+int hdb_delete(void *h, const char *key){
+    DB *db = h;
+    int rc;
+
+    //删除需要修改哈希链表，因此需要加写锁
+    if(_db_find_and_lock(db,key,1)==0){
+        _db_dodelete(db);
+        db->cnt_delok++;
+        rc = 0;
+    }else{
+        db->cnt_delerr++;
+        rc = -1;
+    }
+    if(_db_un_lock(db,db->chainoff,SEEK_SET,1)<0) err_dump("db_delete un_lock error");
+    return rc;
+}
+
+//顺序读取下一条记录，返回数据，并且将键拷贝到key中(key可以为NULL)
+//读取的起点由hdb_rewind设置，已经被删除的记录(键为空白)会被跳过
+char* hdb_nextrec(void *h, char *key){
+    DB *db = h;
+    char c;
+    char *ptr;
+
+    //对空闲链表加读锁，防止读取的过程中有其他进程删除记录
+    if(_db_readw_lock(db,FREE_OFF,SEEK_SET,1)<0) err_dump("db_nextrec readw_lock error");
+
+    do{
+        //读取下一条索引记录，到达文件末尾时返回NULL
+        if(_db_skiphole(db)<0 || _db_readidx(db,0)<0){
+            ptr = NULL;
+            goto doreturn;
+        }
+        //检查键是否全为空白
+        ptr = db->idxbuf;
+        while((c = *ptr++)!=0 && c==SPACE);
+    }while(c==0);
+
+    if(key!=NULL) strcpy(key,db->idxbuf);
+    ptr = _db_readdat(db);
+    db->cnt_nextrec++;
+
+doreturn:
+    if(_db_un_lock(db,FREE_OFF,SEEK_SET,1)<0) err_dump("db_nextrec un_lock error");
+    return ptr;
+}
+
+//按命中次数从高到低排序，次数相同时保持原来的先后顺序
+static int _db_hotcmp(const void *a, const void *b){
+    const CHAINREC *x = a, *y = b;
+
+    if(x->hits!=y->hits) return x->hits>y->hits ? -1 : 1;
+    return x->pos<y->pos ? -1 : 1;
+}
+
+//按照命中次数从高到低重写每条哈希链表的顺序，返回重写的链表数
+//每条链表在它自己的写锁下处理，不会长时间阻塞其他进程；处理完所有链表后命中次数减半，让旧的热度逐渐消失
+//与_db_movehit一样不是崩溃安全的，见_db_movehit前的说明
+int hdb_reorder(void *h){
+    DB *db = h;
+    CHAINREC *rec = NULL;
+    HOTENT *old;
+    COUNT *hits;
+    off_t chainoff, offset, next;
+    size_t n, j, nrec = 0;
+    DBHASH i;
+    int sorted, nchain = 0;
+
+    if(db->hot==NULL) return 0;
+    for(i=0;i<db->nhash;i++){
+        chainoff = db->hashoff+i*PTR_SZ;
+        if(_db_writew_lock(db,chainoff,SEEK_SET,1)<0) err_dump("db_reorder: writew_lock error");
+
+        //读出整条链表，只需要每条索引记录开头的指针
+        n = 0;
+        sorted = 1;
+        offset = _db_readptr(db,chainoff);
+        while(offset!=0){
+            if(n==nrec){
+                nrec = nrec==0 ? 64 : nrec*2;
+                if((rec = realloc(rec,nrec*sizeof(CHAINREC)))==NULL) err_dump("db_reorder: realloc error");
+            }
+            rec[n].off = offset;
+            rec[n].next = _db_readptr(db,offset);
+            rec[n].hits = (hits = _db_hotslot(db,offset,0))!=NULL ? *hits : 0;
+            rec[n].pos = n;
+            if(n>0 && rec[n].hits>rec[n-1].hits) sorted = 0;
+            offset = rec[n++].next;
+        }
+
+        if(!sorted){
+            //从尾部往前重新链接，只写改变了的指针，最后更新链表头
+            qsort(rec,n,sizeof(CHAINREC),_db_hotcmp);
+            for(j=n;j-->0;){
+                next = j+1<n ? rec[j+1].off : 0;
+                if(rec[j].next!=next) _db_writeptr(db,rec[j].off,next);
+            }
+            _db_writeptr(db,chainoff,rec[0].off);
+            db->cnt_reorders++;
+            nchain++;
+        }
+        if(_db_un_lock(db,chainoff,SEEK_SET,1)<0) err_dump("db_reorder: un_lock error");
+    }
+    free(rec);
+
+    //命中次数减半，减到0的记录从表中去掉
+    old = db->hot;
+    if((db->hot = calloc(HOT_SZ,sizeof(HOTENT)))==NULL) err_dump("db_reorder: calloc error");
+    db->nhot = 0;
+    for(j=0;j<HOT_SZ;j++){
+        if(old[j].off!=0 && old[j].hits/2>0 && (hits = _db_hotslot(db,old[j].off,1))!=NULL)
+            *hits = old[j].hits/2;
+    }
+    free(old);
+    return nchain;
+}
+
+//将计数器累加到st中
+void hdb_stats(void *h, DBSTAT *st){
+    DB *db = h;
+
+    st->delok    += db->cnt_delok;
+    st->delerr   += db->cnt_delerr;
+    st->fetchok  += db->cnt_fetchok;
+    st->fetcherr += db->cnt_fetcherr;
+    st->nextrec  += db->cnt_nextrec;
+    st->stor1    += db->cnt_stor1;
+    st->stor2    += db->cnt_stor2;
+    st->stor3    += db->cnt_stor3;
+    st->stor4    += db->cnt_stor4;
+    st->storerr  += db->cnt_storerr;
+    st->zstored  += db->cnt_zstored;
+    st->zskipped += db->cnt_zskipped;
+    st->zrawbytes += db->cnt_zrawbytes;
+    st->zbytes   += db->cnt_zbytes;
+    st->zcompns  += db->cnt_zcompns;
+    st->zdecompns += db->cnt_zdecompns;
+    st->fetchhops += db->cnt_fetchhops;
+    st->moves    += db->cnt_moves;
+    st->moveskips += db->cnt_moveskips;
+    st->reorders += db->cnt_reorders;
+}
+
+//判断pathname对应的分片是否已经存在
+int hdb_exists(const char *pathname){
+    char name[PATH_MAX];
+
+    snprintf(name,sizeof(name),"%s.idx",pathname);
+    return access(name,F_OK)==0;
+}
+
+//删除pathname对应分片的idx/dat文件，db_open以O_TRUNC改变分片数时使用
+int hdb_remove(const char *pathname){
+    char name[PATH_MAX];
+
+    snprintf(name,sizeof(name),"%s.idx",pathname);
+    if(unlink(name)<0 && errno!=ENOENT) return -1;
+    snprintf(name,sizeof(name),"%s.dat",pathname);
+    if(unlink(name)<0 && errno!=ENOENT) return -1;
+    return 0;
+}
+
+const DBENGINE hdb_engine = {
+    hdb_exists, hdb_remove, hdb_open, hdb_close, hdb_fetch, hdb_store,
+    hdb_delete, hdb_rewind, hdb_nextrec, hdb_stats, hdb_reorder
+};
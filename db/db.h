@@ -1,17 +1,85 @@
 #ifndef _DB_H
 #define _DB_H
 
+#include <stddef.h>		/* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 //一些函数、宏定义
 
 typedef	void *	DBHANDLE;
 
+/*
+ * Options for db_open_opt().
+ */
+typedef struct {
+    int nshard;     //分片数（每个分片是一组独立的文件），0表示沿用已有文件的分片数，新库默认为1；与已有文件不一致时，O_TRUNC会删除原来的分片重新创建，否则db_open_opt返回EINVAL
+    int engine;     //存储引擎，DB_ENGINE_AUTO表示沿用已有文件的引擎，新库默认为DB_ENGINE_HASH
+    int flags;      //DB_NOLOCK等选项
+    const char *changelog;  //不为NULL时，每次成功的db_store/db_delete都会追加到这个变更日志文件中
+} DBOPT;
+
+/*
+ * Flags for DBOPT.flags.
+ */
+#define DB_NOLOCK	0x01	/* hash engine: no fcntl locks (single-writer replica) */
+#define DB_COMPRESS	0x02	/* hash engine: compress new data records (built-in LZ) */
+#define DB_COMPRESS_ZLIB 0x04	/* hash engine: compress with zlib, LZ if built without it */
+#define DB_REORDER	0x08	/* hash engine: count hits per record for db_reorder() */
+#define DB_MTF		0x10	/* hash engine: move a fetched record to the chain head (implies DB_REORDER), not crash-safe */
+#define DB_TRANSPOSE	0x20	/* hash engine: swap a fetched record with its predecessor (implies DB_REORDER), not crash-safe */
+
+/*
+ * Storage engines for DBOPT.engine.
+ */
+#define DB_ENGINE_AUTO	   0	/* detect from existing files */
+#define DB_ENGINE_HASH	   1	/* idx/dat hash chains, in-place updates */
+#define DB_ENGINE_LOG	   2	/* append-only log + in-memory keydir, single process */
+
+/*
+ * Counters returned by db_stats(), summed over all shards.
+ */
+typedef struct {
+    int           nshard;    /* number of shards */
+    unsigned long delok;     /* delete OK */
+    unsigned long delerr;    /* delete error */
+    unsigned long fetchok;   /* fetch OK */
+    unsigned long fetcherr;  /* fetch error */
+    unsigned long nextrec;   /* nextrec */
+    unsigned long stor1;     /* store: DB_INSERT, no empty, appended */
+    unsigned long stor2;     /* store: DB_INSERT, found empty, reused */
+    unsigned long stor3;     /* store: DB_REPLACE, same len, overwrote */
+    unsigned long stor4;     /* store: DB_REPLACE, diff len, appended */
+    unsigned long storerr;   /* store error */
+    unsigned long merges;    /* log engine: merges completed */
+    unsigned long zstored;   /* store: data records written compressed */
+    unsigned long zskipped;  /* store: compression didn't pay off, written raw */
+    unsigned long zrawbytes; /* compressed records: bytes before compression */
+    unsigned long zbytes;    /* compressed records: bytes after compression */
+    unsigned long zcompns;   /* nanoseconds spent compressing */
+    unsigned long zdecompns; /* nanoseconds spent decompressing */
+    unsigned long fetchhops; /* hash engine: index records read by fetches */
+    unsigned long moves;     /* fetch hit moved forward in its chain */
+    unsigned long moveskips; /* move skipped, chain locked by another process */
+    unsigned long reorders;  /* chains rewritten by db_reorder() */
+} DBSTAT;
+
 DBHANDLE  db_open(const char *, int, ...);
+DBHANDLE  db_open_opt(const char *, int, int, const DBOPT *);
 void      db_close(DBHANDLE);
 char     *db_fetch(DBHANDLE, const char *);
 int       db_store(DBHANDLE, const char *, const char *, int);
 int       db_delete(DBHANDLE, const char *);
 void      db_rewind(DBHANDLE);
 char     *db_nextrec(DBHANDLE, char *);
+void      db_stats(DBHANDLE, DBSTAT *);
+int       db_keyshard(DBHANDLE, const char *);
+int       db_reorder(DBHANDLE, int);
+char     *db_fetchn(DBHANDLE, const char *, size_t, size_t *);
+int       db_storen(DBHANDLE, const char *, size_t, const char *, size_t, int);
+int       db_deleten(DBHANDLE, const char *, size_t);
 
 /*
  * Flags for db_store().
@@ -27,5 +95,10 @@ char     *db_nextrec(DBHANDLE, char *);
 #define IDXLEN_MAX	1024	/* arbitrary */
 #define DATLEN_MIN	   2	/* data byte, newline */
 #define DATLEN_MAX	1024	/* arbitrary */
+#define NSHARD_MAX	  64	/* max shards per database */
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* _APUE_DB_H */
@@ -0,0 +1,160 @@
+#ifndef _DB_HPP
+#define _DB_HPP
+
+/*
+ * Header-only C++17 front-end for db.h.
+ *
+ * Keys and values are passed as std::string_view (or any contiguous
+ * char range for values) and go through the length-taking db_*n calls,
+ * so the hot path never allocates a std::string.  It is not copy-free:
+ * db_storen/db_fetchn/db_deleten copy the key (and value) into a
+ * NUL-terminated stack buffer for the engine, which measures them again.
+ * Fetch results are views into the shard's read buffer.
+ *
+ * Lifetime rule: a view returned by get() or produced by iteration is
+ * valid only until the next call on the same Db (any call, including
+ * another get()).  Copy it into a std::string if it has to live longer.
+ *
+ * Like DBHANDLE, a Db must not be used from several threads at once.
+ */
+
+#include "db.h"
+
+#include <fcntl.h>
+#include <cerrno>
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+namespace simpledb {
+
+class Db {
+public:
+    //对应db_open_opt，失败时抛出std::system_error
+    Db(const char *path, int flags, int mode = 0644, const DBOPT *opt = nullptr)
+        : h_(db_open_opt(path, flags, mode, opt)) {
+        if (h_ == nullptr)
+            throw std::system_error(errno, std::generic_category(), path);
+    }
+
+    ~Db() {
+        if (h_ != nullptr)
+            db_close(h_);
+    }
+
+    //句柄只能移动，不能拷贝
+    Db(const Db &) = delete;
+    Db &operator=(const Db &) = delete;
+
+    Db(Db &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+
+    Db &operator=(Db &&other) noexcept {
+        if (this != &other) {
+            if (h_ != nullptr)
+                db_close(h_);
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+
+    //读取key对应的值，找不到时返回std::nullopt
+    //返回的视图在下一次调用这个Db之前有效
+    std::optional<std::string_view> get(std::string_view key) {
+        size_t len;
+        const char *p = db_fetchn(h_, key.data(), key.size(), &len);
+        if (p == nullptr)
+            return std::nullopt;
+        return std::string_view(p, len);
+    }
+
+    //写入一条记录，flag与db_store相同；失败返回false，原因见errno
+    //value可以是std::string_view，也可以是任何提供data()/size()的连续char序列(std::vector<char>、std::array、std::span等)
+    bool put(std::string_view key, std::string_view value, int flag = DB_STORE) {
+        return db_storen(h_, key.data(), key.size(), value.data(), value.size(), flag) >= 0;
+    }
+
+    template <class Bytes,
+              class = std::enable_if_t<!std::is_convertible_v<const Bytes &, std::string_view>>>
+    auto put(std::string_view key, const Bytes &value, int flag = DB_STORE)
+        -> decltype(static_cast<const char *>(std::data(value)), std::size(value), bool()) {
+        return put(key, std::string_view(std::data(value), std::size(value)), flag);
+    }
+
+    //删除一条记录，记录不存在时返回false
+    bool erase(std::string_view key) {
+        return db_deleten(h_, key.data(), key.size()) == 0;
+    }
+
+    DBSTAT stats() const {
+        DBSTAT st;
+        db_stats(h_, &st);
+        return st;
+    }
+
+    DBHANDLE handle() const { return h_; }
+
+    //遍历时得到的一条记录，两个视图都在迭代器前进之前有效
+    struct Record {
+        std::string_view key;
+        std::string_view value;
+    };
+
+    //输入迭代器，基于db_rewind/db_nextrec，因此同一个Db同一时刻只能有一个遍历
+    class iterator {
+    public:
+        using value_type = Record;
+        using reference = const Record &;
+        using pointer = const Record *;
+        using difference_type = std::ptrdiff_t;
+        using iterator_category = std::input_iterator_tag;
+
+        iterator() = default;
+
+        reference operator*() const { return rec_; }
+        pointer operator->() const { return &rec_; }
+
+        iterator &operator++() {
+            next();
+            return *this;
+        }
+
+        bool operator==(const iterator &o) const { return db_ == o.db_; }
+        bool operator!=(const iterator &o) const { return db_ != o.db_; }
+
+    private:
+        friend class Db;
+
+        explicit iterator(Db *db) : db_(db) {
+            db_rewind(db_->h_);
+            next();
+        }
+
+        void next() {
+            const char *v = db_nextrec(db_->h_, db_->key_);
+            if (v == nullptr) {
+                db_ = nullptr;  //到达末尾，等于end()
+                return;
+            }
+            rec_.key = std::string_view(db_->key_);
+            rec_.value = std::string_view(v);
+        }
+
+        Db *db_ = nullptr;
+        Record rec_;
+    };
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+
+private:
+    DBHANDLE h_;
+    char key_[IDXLEN_MAX + 1];  //db_nextrec拷贝键的缓冲区
+};
+
+}  // namespace simpledb
+
+#endif /* _DB_HPP */
@@ -0,0 +1,391 @@
+#include "dbint.h"
+#include "apue.h"
+
+#include <fcntl.h>		/* open & db_open flags */
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>	/* PATH_MAX */
+#include <pthread.h>
+#include <sys/time.h>
+
+/*
+ * 分片层：一个DBHANDLE背后是nshard对相互独立的idx/dat文件，
+ * 每个键根据哈希值固定路由到其中一个分片。
+ * 各分片有各自的文件、空闲链表和追加锁，因此写不同分片的进程之间不会产生锁竞争。
+ *
+ * 文件命名：只有一个分片时沿用 name.idx/name.dat，
+ * 多个分片时为 name.0.idx/name.0.dat ... name.N-1.idx/name.N-1.dat。
+ *
+ * 变更日志：打开时指定了DBOPT.changelog，每次成功的store/delete都会以一次write追加一条记录，
+ * 供simpledb-follower回放到只读副本上。记录格式(长度都是十进制)：
+ *     S <微秒时间戳> <键长> <值长>\n<键><值>\n
+ *     D <微秒时间戳> <键长> 0\n<键>\n
+ * 对同一个键，修改引擎与追加日志在同一把锁内完成，因此多个进程写同一个键时，日志中的顺序与实际生效的顺序一致。
+ * 这把锁是日志文件中的一个字节：每个分片占NLOGLOCK个字节，分片内由键的哈希选择，写不同分片的进程不会互相等待。
+ * fcntl记录锁属于进程，同一进程的两个线程锁同一个字节都会成功，因此加记录锁之前还要持有进程内的互斥锁。
+ */
+typedef struct{
+    const DBENGINE *eng;    //所有分片使用的存储引擎
+    int         nshard;     //分片数
+    void      **shard;      //各分片的句柄
+    int         scanshard;  //db_nextrec当前扫描到的分片
+    int         logfd;      //变更日志的文件描述符，没有启用时为-1
+    pthread_mutex_t *logmtx;    //日志锁字节对应的进程内互斥锁，共NLOGMTX把，没有启用变更日志时为NULL
+}DBSET;
+
+#define NLOGLOCK	1024	/* change log: per-key lock bytes per shard */
+#define NLOGMTX		64	/* change log: in-process mutexes guarding the lock bytes */
+#define LOGHDR_MAX	64	/* change log: max record header length */
+
+static const DBENGINE *_dbs_engines[] = {
+    NULL,           /* DB_ENGINE_AUTO */
+    &hdb_engine,    /* DB_ENGINE_HASH */
+    &ldb_engine,    /* DB_ENGINE_LOG */
+};
+#define NENGINE (sizeof(_dbs_engines)/sizeof(_dbs_engines[0]))
+
+static int     _dbs_delete(DBSET *, const char *);
+static void    _dbs_free(DBSET *, int);
+static unsigned long _dbs_keyhash(const char *);
+static off_t   _dbs_loglock(DBSET *, const char *);
+static void    _dbs_logunlock(DBSET *, off_t);
+static void    _dbs_logop(DBSET *, int, const char *, const char *);
+static int     _dbs_probe(const char *, int *);
+static int     _dbs_route(DBSET *, const char *);
+static void    _dbs_shardname(char *, const char *, int, int);
+static int     _dbs_store(DBSET *, const char *, const char *, int);
+
+//生成第i个分片的文件名(不带后缀)
+static void _dbs_shardname(char *buf, const char *pathname, int nshard, int i){
+    if(nshard==1) strcpy(buf,pathname);
+    else sprintf(buf,"%s.%d",pathname,i);
+}
+
+//探测已有数据库的分片数以及使用的引擎，找不到任何分片文件时返回0
+//*engine为DB_ENGINE_AUTO时会被设置为探测到的引擎(没有探测到时为DB_ENGINE_HASH)
+static int _dbs_probe(const char *pathname, int *engine){
+    char name[PATH_MAX];
+    int n, e;
+
+    for(e=1;e<NENGINE;e++){
+        if(*engine!=DB_ENGINE_AUTO && *engine!=e) continue;
+        if(_dbs_engines[e]->exists(pathname)){
+            *engine = e;
+            return 1;
+        }
+        for(n=0;n<NSHARD_MAX;n++){
+            snprintf(name,sizeof(name),"%s.%d",pathname,n);
+            if(!_dbs_engines[e]->exists(name)) break;
+        }
+        if(n>0){
+            *engine = e;
+            return n;
+        }
+    }
+    if(*engine==DB_ENGINE_AUTO) *engine = DB_ENGINE_HASH;
+    return 0;
+}
+
+//键的FNV-1a哈希，与分片内部选择哈希桶的_db_hash相互独立，保证每个分片内的键仍能均匀分布到所有哈希桶中
+static unsigned long _dbs_keyhash(const char *key){
+    unsigned long hval = 2166136261UL;
+
+    while(*key){
+        hval ^= (unsigned char)*key++;
+        hval *= 16777619UL;
+        hval &= 0xffffffffUL;
+    }
+    return hval;
+}
+
+//根据键计算所在的分片
+static int _dbs_route(DBSET *dbs, const char *key){
+    if(dbs->nshard==1) return 0;
+    return _dbs_keyhash(key) % dbs->nshard;
+}
+
+//关闭前n个已经打开的分片并释放DBSET
+static void _dbs_free(DBSET *dbs, int n){
+    int i;
+    for(i=0;i<n;i++){
+        if(dbs->shard[i]!=NULL) dbs->eng->close(dbs->shard[i]);
+    }
+    if(dbs->logfd>=0) close(dbs->logfd);
+    if(dbs->logmtx!=NULL){
+        for(i=0;i<NLOGMTX;i++) pthread_mutex_destroy(&dbs->logmtx[i]);
+        free(dbs->logmtx);
+    }
+    free(dbs->shard);
+    free(dbs);
+}
+
+//打开一个数据库，其参数与系统调用open相同，分片数沿用已有文件(新库为1个分片)
+DBHANDLE db_open(const char *pathname, int flags, ...){
+    int mode = 0;
+
+    if(flags & O_CREAT){
+        //创建数据库，我们需要取得第三个权限参数（varargs）
+        va_list ap;
+        va_start(ap,flags);
+        mode = va_arg(ap,mode_t);
+        va_end(ap);
+    }
+    return db_open_opt(pathname,flags,mode,NULL);
+}
+
+//带选项打开一个数据库，opt可以为NULL
+DBHANDLE db_open_opt(const char *pathname, int flags, int mode, const DBOPT *opt){
+    DBSET *dbs;
+    char name[PATH_MAX];
+    int nshard, engine, i;
+
+    engine = opt!=NULL ? opt->engine : DB_ENGINE_AUTO;
+    if(engine<0 || engine>=NENGINE){
+        errno = EINVAL;
+        return NULL;
+    }
+    if(strlen(pathname)+8>sizeof(name)){
+        errno = EINVAL;
+        return NULL;
+    }
+    //已有的库只能按建库时的分片数打开，否则键会被路由到错误的分片上
+    //O_TRUNC时先删掉原来的所有分片，再按新的分片数重新创建
+    nshard = _dbs_probe(pathname,&engine);
+    if(opt!=NULL && opt->nshard>0){
+        if(nshard>0 && nshard!=opt->nshard){
+            if(!(flags & O_TRUNC) || (flags & O_ACCMODE)==O_RDONLY || opt->nshard>NSHARD_MAX){
+                errno = EINVAL;
+                return NULL;
+            }
+            for(i=0;i<nshard;i++){
+                _dbs_shardname(name,pathname,nshard,i);
+                if(_dbs_engines[engine]->remove(name)<0) return NULL;
+            }
+        }
+        nshard = opt->nshard;
+    }else if(nshard==0){
+        nshard = 1;
+    }
+    if(nshard>NSHARD_MAX){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if((dbs = malloc(sizeof(DBSET)))==NULL) err_dump("db_open malloc error");
+    if((dbs->shard = calloc(nshard,sizeof(void *)))==NULL) err_dump("db_open malloc error");
+    dbs->eng = _dbs_engines[engine];
+    dbs->nshard = nshard;
+    dbs->scanshard = 0;
+    dbs->logfd = -1;
+    dbs->logmtx = NULL;
+
+    //只读打开时不会有修改，不需要变更日志
+    if(opt!=NULL && opt->changelog!=NULL && (flags & O_ACCMODE)!=O_RDONLY){
+        if((dbs->logfd = open(opt->changelog,O_WRONLY|O_APPEND|O_CREAT,mode!=0 ? mode : FILE_MODE))<0){
+            _dbs_free(dbs,0);
+            return NULL;
+        }
+        if((dbs->logmtx = malloc(NLOGMTX*sizeof(pthread_mutex_t)))==NULL) err_dump("db_open malloc error");
+        for(i=0;i<NLOGMTX;i++) pthread_mutex_init(&dbs->logmtx[i],NULL);
+    }
+
+    for(i=0;i<nshard;i++){
+        _dbs_shardname(name,pathname,nshard,i);
+        if((dbs->shard[i] = dbs->eng->open(name,flags,mode,opt))==NULL){
+            _dbs_free(dbs,i);
+            return NULL;
+        }
+    }
+    return(dbs);
+}
+
+void db_close(DBHANDLE h){
+    DBSET *dbs = h;
+    _dbs_free(dbs,dbs->nshard);
+}
+
+char* db_fetch(DBHANDLE h, const char *key){
+    DBSET *dbs = h;
+    return dbs->eng->fetch(dbs->shard[_dbs_route(dbs,key)],key,NULL);
+}
+
+//向变更日志追加一条记录，调用者已经持有该键的日志锁
+//data为NULL表示删除
+static void _dbs_logop(DBSET *dbs, int op, const char *key, const char *data){
+    char buf[LOGHDR_MAX+IDXLEN_MAX+DATLEN_MAX+1];
+    struct timeval tv;
+    size_t keylen, datlen, n;
+
+    keylen = strlen(key);
+    datlen = data!=NULL ? strlen(data) : 0;
+    gettimeofday(&tv,NULL);
+    n = sprintf(buf,"%c %lld %zu %zu\n",op,(long long)tv.tv_sec*1000000+tv.tv_usec,keylen,datlen);
+    memcpy(buf+n,key,keylen);
+    n += keylen;
+    memcpy(buf+n,data,datlen);
+    n += datlen;
+    buf[n++] = '\n';
+    //O_APPEND下一次write是原子追加，多个进程的记录不会交错
+    if(write(dbs->logfd,buf,n)!=n) err_dump("db: can't write change log");
+}
+
+//修改一条记录，启用了变更日志时在同一把锁内追加日志
+//锁住key在变更日志中的锁字节，返回它的偏移量
+//分片由哈希值对nshard取模决定，分片内用商来选择锁字节，这样每个分片的NLOGLOCK个字节都会被用到
+static off_t _dbs_loglock(DBSET *dbs, const char *key){
+    unsigned long hval = _dbs_keyhash(key);
+    off_t lockoff;
+
+    lockoff = (off_t)_dbs_route(dbs,key)*NLOGLOCK + (hval/dbs->nshard)%NLOGLOCK;
+    pthread_mutex_lock(&dbs->logmtx[lockoff%NLOGMTX]);
+    if(writew_lock(dbs->logfd,lockoff,SEEK_SET,1)<0) err_dump("db: change log writew_lock error");
+    return lockoff;
+}
+
+static void _dbs_logunlock(DBSET *dbs, off_t lockoff){
+    if(un_lock(dbs->logfd,lockoff,SEEK_SET,1)<0) err_dump("db: change log un_lock error");
+    pthread_mutex_unlock(&dbs->logmtx[lockoff%NLOGMTX]);
+}
+
+static int _dbs_store(DBSET *dbs, const char *key, const char *data, int flag){
+    void *db = dbs->shard[_dbs_route(dbs,key)];
+    off_t lockoff;
+    int rc;
+
+    if(dbs->logfd<0) return dbs->eng->store(db,key,data,flag);
+    //键长和值长不合法时由引擎拒绝，这里只需要保证日志缓冲区不会溢出
+    if(strlen(key)>IDXLEN_MAX || strlen(data)>=DATLEN_MAX){
+        errno = EINVAL;
+        return -1;
+    }
+    lockoff = _dbs_loglock(dbs,key);
+    if((rc = dbs->eng->store(db,key,data,flag))>=0) _dbs_logop(dbs,'S',key,data);
+    _dbs_logunlock(dbs,lockoff);
+    return rc;
+}
+
+static int _dbs_delete(DBSET *dbs, const char *key){
+    void *db = dbs->shard[_dbs_route(dbs,key)];
+    off_t lockoff;
+    int rc;
+
+    if(dbs->logfd<0) return dbs->eng->delete(db,key);
+    if(strlen(key)>IDXLEN_MAX){
+        errno = EINVAL;
+        return -1;
+    }
+    lockoff = _dbs_loglock(dbs,key);
+    if((rc = dbs->eng->delete(db,key))==0) _dbs_logop(dbs,'D',key,NULL);
+    _dbs_logunlock(dbs,lockoff);
+    return rc;
+}
+
+int db_store(DBHANDLE h, const char *key, const char *data, int flag){
+    return _dbs_store(h,key,data,flag);
+}
+
+int db_delete(DBHANDLE h, const char *key){
+    return _dbs_delete(h,key);
+}
+
+//将所有分片的扫描位置重置到第一条记录
+void db_rewind(DBHANDLE h){
+    DBSET *dbs = h;
+    int i;
+
+    for(i=0;i<dbs->nshard;i++) dbs->eng->rewind(dbs->shard[i]);
+    dbs->scanshard = 0;
+}
+
+//依次扫描每个分片，一个分片读完后转到下一个分片
+char* db_nextrec(DBHANDLE h, char *key){
+    DBSET *dbs = h;
+    char *ptr;
+
+    while(dbs->scanshard<dbs->nshard){
+        if((ptr = dbs->eng->nextrec(dbs->shard[dbs->scanshard],key))!=NULL) return ptr;
+        dbs->scanshard++;
+    }
+    return NULL;
+}
+
+//汇总所有分片的计数器
+void db_stats(DBHANDLE h, DBSTAT *st){
+    DBSET *dbs = h;
+    int i;
+
+    memset(st,0,sizeof(DBSTAT));
+    st->nshard = dbs->nshard;
+    for(i=0;i<dbs->nshard;i++) dbs->eng->stats(dbs->shard[i],st);
+}
+
+//返回key所在的分片编号(0到nshard-1)
+//DBHANDLE本身不是线程安全的，多线程共享一个句柄时可以用它为每个分片单独加锁
+int db_keyshard(DBHANDLE h, const char *key){
+    return _dbs_route(h,key);
+}
+
+//按命中次数重写分片内哈希链表的顺序(需要以DB_REORDER、DB_MTF或DB_TRANSPOSE打开)，返回重写的链表数
+//shard为-1时处理所有分片；与db_fetch一样不是线程安全的，多线程共享句柄时需要持有该分片的锁
+//不是崩溃安全的，见db.c中_db_movehit前的说明
+int db_reorder(DBHANDLE h, int shard){
+    DBSET *dbs = h;
+    int i, n = 0;
+
+    if(shard<-1 || shard>=dbs->nshard){
+        errno = EINVAL;
+        return -1;
+    }
+    if(dbs->eng->reorder==NULL) return 0;
+    for(i=0;i<dbs->nshard;i++){
+        if(shard==-1 || shard==i) n += dbs->eng->reorder(dbs->shard[i]);
+    }
+    return n;
+}
+
+/*
+ * 带长度的接口：键和值不需要以\0结尾，db_fetchn同时返回值的长度，调用者不需要再strlen。
+ * 引擎内部仍然使用以\0结尾的字符串，这里在栈上拷贝一次，不会分配内存。
+ */
+char* db_fetchn(DBHANDLE h, const char *key, size_t keylen, size_t *datlen){
+    DBSET *dbs = h;
+    char kbuf[IDXLEN_MAX+1];
+
+    //键中间有\0时截断后会变成另一个键，直接拒绝
+    if(keylen>IDXLEN_MAX || memchr(key,0,keylen)!=NULL){
+        errno = EINVAL;
+        return NULL;
+    }
+    memcpy(kbuf,key,keylen);
+    kbuf[keylen] = 0;
+    return dbs->eng->fetch(dbs->shard[_dbs_route(dbs,kbuf)],kbuf,datlen);
+}
+
+int db_storen(DBHANDLE h, const char *key, size_t keylen, const char *data, size_t datlen, int flag){
+    DBSET *dbs = h;
+    char kbuf[IDXLEN_MAX+1], dbuf[DATLEN_MAX];
+
+    //值的长度还要加上引擎存储的换行符，超过限制的在这里就可以拒绝
+    if(keylen>IDXLEN_MAX || datlen>=DATLEN_MAX || memchr(key,0,keylen)!=NULL || memchr(data,0,datlen)!=NULL){
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(kbuf,key,keylen);
+    kbuf[keylen] = 0;
+    memcpy(dbuf,data,datlen);
+    dbuf[datlen] = 0;
+    return _dbs_store(dbs,kbuf,dbuf,flag);
+}
+
+int db_deleten(DBHANDLE h, const char *key, size_t keylen){
+    DBSET *dbs = h;
+    char kbuf[IDXLEN_MAX+1];
+
+    if(keylen>IDXLEN_MAX || memchr(key,0,keylen)!=NULL){
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(kbuf,key,keylen);
+    kbuf[keylen] = 0;
+    return _dbs_delete(dbs,kbuf);
+}
@@ -0,0 +1,75 @@
+#ifndef _DBINT_H
+#define _DBINT_H
+
+#include "db.h"
+
+//库内部使用的接口，不对外暴露
+
+/*
+ * Storage engine: one shard of a database.
+ * These are the per-shard versions of the db.h functions;
+ * the sharding layer in dbapi.c routes each key to one of them.
+ */
+typedef struct {
+    int    (*exists)(const char *);                 /* shard files present? */
+    int    (*remove)(const char *);                 /* delete the shard files */
+    void  *(*open)(const char *, int, int, const DBOPT *);
+    void   (*close)(void *);
+    char  *(*fetch)(void *, const char *, size_t *);    /* also returns length */
+    int    (*store)(void *, const char *, const char *, int);
+    int    (*delete)(void *, const char *);
+    void   (*rewind)(void *);
+    char  *(*nextrec)(void *, char *);
+    void   (*stats)(void *, DBSTAT *);              /* add counters to DBSTAT */
+    int    (*reorder)(void *);                      /* sort chains by hotness, may be NULL */
+} DBENGINE;
+
+/*
+ * Hash engine: idx/dat file pair with in-place updates (db.c).
+ */
+extern const DBENGINE hdb_engine;
+
+int    hdb_exists(const char *);
+int    hdb_remove(const char *);
+void  *hdb_open(const char *, int, int, const DBOPT *);
+void   hdb_close(void *);
+char  *hdb_fetch(void *, const char *, size_t *);
+int    hdb_store(void *, const char *, const char *, int);
+int    hdb_delete(void *, const char *);
+void   hdb_rewind(void *);
+char  *hdb_nextrec(void *, char *);
+void   hdb_stats(void *, DBSTAT *);
+int    hdb_reorder(void *);
+
+/*
+ * Log engine: append-only segments plus an in-memory keydir (dblog.c).
+ */
+extern const DBENGINE ldb_engine;
+
+int    ldb_exists(const char *);
+int    ldb_remove(const char *);
+void  *ldb_open(const char *, int, int, const DBOPT *);
+void   ldb_close(void *);
+char  *ldb_fetch(void *, const char *, size_t *);
+int    ldb_store(void *, const char *, const char *, int);
+int    ldb_delete(void *, const char *);
+void   ldb_rewind(void *);
+char  *ldb_nextrec(void *, char *);
+void   ldb_stats(void *, DBSTAT *);
+
+/*
+ * Record compression codecs (dbz.c).
+ * The codec char is kept in the index record of a compressed data record.
+ */
+#define DBZ_LZ		'l'	/* built-in LZ77, always available */
+#define DBZ_ZLIB	'z'	/* raw deflate, only when built with zlib */
+
+typedef struct dbz DBZ;     /* per-shard codec state */
+
+int    dbz_available(int);
+DBZ   *dbz_alloc(void);
+void   dbz_free(DBZ *);
+size_t dbz_compress(DBZ *, int, const char *, size_t, char *, size_t);
+size_t dbz_decompress(DBZ *, int, const char *, size_t, char *, size_t);
+
+#endif /* _DBINT_H */
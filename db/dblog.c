@@ -0,0 +1,1022 @@
+#include "dbint.h"
+#include "apue.h"
+
+#include <fcntl.h>		/* open & db_open flags */
+#include <errno.h>
+#include <limits.h>	/* PATH_MAX */
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/*
+ * 日志引擎(Bitcask风格)：
+ * 键和值都只追加写入段文件，内存中的keydir记录每个键最新一条记录所在的段和偏移量。
+ * 每次store/delete都只是一次顺序追加，不会原地修改任何已经写入的内容。
+ * 后台线程负责合并(merge)：把不可变段中仍然有效的记录复制到新段，同时写出hint文件，
+ * 之后删除旧段；db_open时有hint文件的段只需要读取hint，不需要扫描整个段。
+ *
+ * 一个分片对应的文件(name为分片名)：
+ *   name.lck          进程锁文件，同一时间只允许一个进程以读写方式打开
+ *   name.<id>.log     段文件，id递增，最大的为当前追加的活跃段
+ *   name.<id>.hint    合并时生成的段的hint文件
+ *   name.merge        合并的清单，列出这次合并要删除的旧段
+ *
+ * 段中的记录结构(本机字节序)：
+ *   | crc32 | 序号seq | 键长度 | 值长度 | 键 | 值 |
+ * 值长度为LDB_TOMB时表示删除标记，没有值部分。
+ * 恢复时同一个键以seq最大的记录为准，因此段的顺序不影响结果。
+ *
+ * hint文件结构：
+ *   | 序号seq | 记录偏移量 | 值长度 | 键长度 | 键 | ...
+ *
+ * 合并会丢弃删除标记，但被删除的键更早的记录可能在编号更大的段中(上一次合并的输出段)，
+ * 逐个删除旧段的途中崩溃会让这样的键重新出现。因此旧段要整体删除：
+ * 先把要删除的段写入清单并刷到磁盘，再删除各段，最后删除清单；
+ * db_open时如果清单还在，先删完清单中的段，它们的内容都已经在新段中了。
+ */
+
+#define LREC_HDR     18	/* crc(4) + seq(8) + keylen(2) + vallen(4) */
+#define LHINT_HDR    22	/* seq(8) + off(8) + vallen(4) + keylen(2) */
+#define LDB_TOMB     0xffffffffU	/* vallen of a delete marker */
+#define LDB_SEGMAX   (1 << 20)	/* roll the active segment at this size */
+#define LDB_MERGEMIN (LDB_SEGMAX / 2)	/* min dead bytes before merging */
+#define LDB_NTAB_DEF 1024	/* initial keydir buckets */
+
+typedef unsigned long	COUNT;	/* unsigned counter */
+
+//keydir中的一项
+typedef struct ldb_ent{
+    struct ldb_ent    *next;    //哈希链表中的下一项
+    unsigned long long seq;     //记录的序号
+    unsigned int       seg;     //记录所在段的id
+    unsigned int       mark;    //db_nextrec已经返回过这一项时等于LDB.scanepoch
+    off_t              off;     //记录在段中的偏移量
+    unsigned int       vallen;  //值的长度，LDB_TOMB表示删除标记(只在恢复过程中出现)
+    unsigned short     keylen;  //键的长度
+    char               key[1];  //键，实际长度为keylen
+}LENT;
+
+//一个段文件
+typedef struct{
+    unsigned int id;
+    int          fd;
+    off_t        size;  //段的大小
+    off_t        dead;  //段中已经失效的记录的字节数
+}LSEG;
+
+typedef struct{
+    char   *name;       //分片名
+    int     mode;       //新建段文件的权限
+    int     lockfd;     //锁文件fd
+    int     rdonly;     //只读打开时不创建活跃段，也不启动合并线程
+
+    LENT  **tab;        //keydir哈希表
+    size_t  ntab;       //哈希桶个数
+    size_t  nent;       //keydir中的项数
+
+    LSEG   *seg;        //所有段，按照id从小到大排序
+    int     nseg;
+    int     maxseg;
+    unsigned int nextid;    //下一个新段的id
+    unsigned int activeid;  //活跃段的id，0表示没有活跃段
+    off_t   totsize;    //所有段的总大小
+    off_t   totdead;    //所有段中失效记录的总字节数
+
+    unsigned long long seq; //下一条记录的序号
+
+    char   *recbuf;     //组装待追加记录的缓冲区
+    char   *databuf;    //读取值的缓冲区
+
+    size_t  scanb;      //db_nextrec当前扫描到的哈希桶
+    LENT   *scane;      //db_nextrec下一个要检查的项，ldb_delete删除它时会后移
+    unsigned int scanepoch; //每次rewind加一，用来识别本次遍历已经返回过的项
+
+    //keydir、段表和计数器都由mtx保护，前台操作和合并线程之间通过它互斥
+    pthread_mutex_t mtx;
+    pthread_cond_t  cond;   //需要合并或者需要退出时通知合并线程
+    pthread_t       tid;
+    int             hasthread;
+    int             stop;
+
+    COUNT  cnt_delok;    /* delete OK */
+    COUNT  cnt_delerr;   /* delete error */
+    COUNT  cnt_fetchok;  /* fetch OK */
+    COUNT  cnt_fetcherr; /* fetch error */
+    COUNT  cnt_nextrec;  /* nextrec */
+    COUNT  cnt_stor1;    /* store: new key, appended */
+    COUNT  cnt_stor4;    /* store: existing key, appended */
+    COUNT  cnt_storerr;  /* store error */
+    COUNT  cnt_merge;    /* merges completed */
+}LDB;
+
+//内部函数
+
+static int      _ldb_addseg(LDB *, unsigned int, int, off_t);
+static void     _ldb_apply(LDB *, unsigned long long, unsigned int, off_t,
+                  const char *, size_t, unsigned int);
+static off_t    _ldb_append(char *, unsigned long long,
+                  const char *, size_t, const char *, unsigned int);
+static unsigned long _ldb_crc(const char *, size_t);
+static void     _ldb_crcinit(void);
+static void     _ldb_dead(LDB *, unsigned int, off_t);
+static int      _ldb_findseg(LDB *, unsigned int);
+static void     _ldb_free(LDB *);
+static size_t   _ldb_hash(const char *, size_t);
+static int      _ldb_listsegs(const char *, unsigned int **);
+static int      _ldb_loadhint(LDB *, unsigned int, const char *);
+static int      _ldb_readmanifest(const char *, unsigned int **);
+static LENT   **_ldb_lookup(LDB *, const char *, size_t);
+static void     _ldb_merge(LDB *);
+static void    *_ldb_mergethread(void *);
+static int      _ldb_needmerge(LDB *);
+static int      _ldb_newseg(LDB *);
+static off_t    _ldb_put(LDB *, const char *, size_t, const char *, unsigned int);
+static char    *_ldb_readval(LDB *, LENT *);
+static void     _ldb_reclaim(LDB *, unsigned int *, int);
+static void     _ldb_rehash(LDB *);
+static int      _ldb_scanseg(LDB *, unsigned int, int, off_t);
+static void     _ldb_segname(char *, const char *, unsigned int, const char *);
+static void     _ldb_syncdir(const char *);
+static void     _ldb_writehint(LDB *, unsigned int, int, const char *, size_t);
+static void     _ldb_writemanifest(LDB *, unsigned int *, int);
+
+#define RECLEN(klen, vlen) \
+	(LREC_HDR + (klen) + ((vlen) == LDB_TOMB ? 0 : (vlen)))
+
+static unsigned long	crctab[256];
+static pthread_once_t	crconce = PTHREAD_ONCE_INIT;
+
+//生成CRC32查找表
+static void _ldb_crcinit(void){
+    unsigned long c;
+    int i, k;
+
+    for(i=0;i<256;i++){
+        c = i;
+        for(k=0;k<8;k++) c = c&1 ? 0xedb88320UL^(c>>1) : c>>1;
+        crctab[i] = c;
+    }
+}
+
+static unsigned long _ldb_crc(const char *buf, size_t len){
+    unsigned long c = 0xffffffffUL;
+
+    while(len-->0) c = crctab[(c^(unsigned char)*buf++)&0xff]^(c>>8);
+    return c^0xffffffffUL;
+}
+
+//生成段文件或hint文件的文件名
+static void _ldb_segname(char *buf, const char *name, unsigned int id, const char *suffix){
+    snprintf(buf,PATH_MAX,"%s.%06u.%s",name,id,suffix);
+}
+
+//列出分片name的所有段，返回段的个数，*ids按照从小到大的顺序存放各段的id(由调用者释放)
+static int _ldb_listsegs(const char *name, unsigned int **ids){
+    char dir[PATH_MAX];
+    const char *base;
+    DIR *dp;
+    struct dirent *dirp;
+    size_t blen;
+    char *end;
+    unsigned long id;
+    unsigned int t;
+    int n = 0, max = 16, i, j;
+
+    //拆分出目录名和文件名前缀
+    if((base = strrchr(name,'/'))!=NULL){
+        snprintf(dir,sizeof(dir),"%.*s",(int)(base-name)+1,name);
+        base++;
+    }else{
+        strcpy(dir,".");
+        base = name;
+    }
+    blen = strlen(base);
+
+    if((*ids = malloc(max*sizeof(unsigned int)))==NULL) err_dump("_ldb_listsegs: malloc error");
+    if((dp = opendir(dir))==NULL) return 0;
+    while((dirp = readdir(dp))!=NULL){
+        //文件名必须严格是 base.<数字>.log
+        if(strncmp(dirp->d_name,base,blen)!=0 || dirp->d_name[blen]!='.') continue;
+        if(dirp->d_name[blen+1]<'0' || dirp->d_name[blen+1]>'9') continue;
+        id = strtoul(dirp->d_name+blen+1,&end,10);
+        if(strcmp(end,".log")!=0 || id==0) continue;
+        if(n==max){
+            max *= 2;
+            if((*ids = realloc(*ids,max*sizeof(unsigned int)))==NULL) err_dump("_ldb_listsegs: realloc error");
+        }
+        (*ids)[n++] = id;
+    }
+    closedir(dp);
+
+    //段的个数不多，插入排序即可
+    for(i=1;i<n;i++){
+        t = (*ids)[i];
+        for(j=i;j>0 && (*ids)[j-1]>t;j--) (*ids)[j] = (*ids)[j-1];
+        (*ids)[j] = t;
+    }
+    return n;
+}
+
+//读取分片name的合并清单，返回其中段的个数，没有清单时返回0，*ids由调用者释放
+static int _ldb_readmanifest(const char *name, unsigned int **ids){
+    char path[PATH_MAX];
+    struct stat statbuff;
+    ssize_t len;
+    int fd;
+
+    *ids = NULL;
+    snprintf(path,sizeof(path),"%s.merge",name);
+    if((fd = open(path,O_RDONLY))<0){
+        if(errno==ENOENT) return 0;
+        err_sys("_ldb_readmanifest: open error for %s",path);
+    }
+    if(fstat(fd,&statbuff)<0) err_sys("_ldb_readmanifest: fstat error");
+    if((*ids = malloc(statbuff.st_size+sizeof(unsigned int)))==NULL) err_dump("_ldb_readmanifest: malloc error");
+    if((len = read(fd,*ids,statbuff.st_size))!=statbuff.st_size || len%sizeof(unsigned int)!=0)
+        err_quit("_ldb_readmanifest: corrupt manifest %s",path);
+    close(fd);
+    return len/sizeof(unsigned int);
+}
+
+//把分片所在目录的修改(改名、删除)刷到磁盘
+static void _ldb_syncdir(const char *name){
+    char dir[PATH_MAX];
+    const char *base;
+    int fd;
+
+    if((base = strrchr(name,'/'))!=NULL) snprintf(dir,sizeof(dir),"%.*s",(int)(base-name)+1,name);
+    else strcpy(dir,".");
+    if((fd = open(dir,O_RDONLY))<0 || fsync(fd)<0) err_sys("_ldb_syncdir: fsync error for %s",dir);
+    close(fd);
+}
+
+//删除分片name的所有文件，db_open以O_TRUNC改变分片数时使用
+//分片正被其他进程打开时失败，errno为EAGAIN或EACCES
+int ldb_remove(const char *name){
+    char path[PATH_MAX];
+    unsigned int *ids;
+    int n, j, fd;
+
+    snprintf(path,sizeof(path),"%s.lck",name);
+    if((fd = open(path,O_RDWR))>=0 && write_lock(fd,0,SEEK_SET,0)<0){
+        close(fd);
+        return -1;
+    }
+    n = _ldb_listsegs(name,&ids);
+    for(j=0;j<n;j++){
+        _ldb_segname(path,name,ids[j],"log");
+        unlink(path);
+        _ldb_segname(path,name,ids[j],"hint");
+        unlink(path);
+    }
+    free(ids);
+    snprintf(path,sizeof(path),"%s.merge",name);
+    unlink(path);
+    snprintf(path,sizeof(path),"%s.lck",name);
+    unlink(path);
+    if(fd>=0) close(fd);
+    return 0;
+}
+
+//判断分片name是否存在(至少有一个段文件)
+int ldb_exists(const char *name){
+    unsigned int *ids;
+    int n;
+
+    n = _ldb_listsegs(name,&ids);
+    free(ids);
+    return n>0;
+}
+
+static size_t _ldb_hash(const char *key, size_t len){
+    unsigned long long hval = 14695981039346656037ULL;
+
+    while(len-->0){
+        hval ^= (unsigned char)*key++;
+        hval *= 1099511628211ULL;
+    }
+    return (size_t)hval;
+}
+
+//在keydir中查找键，返回指向该项的指针的地址(找不到时*返回值为NULL，可以直接用于插入)
+static LENT **_ldb_lookup(LDB *l, const char *key, size_t klen){
+    LENT **pp;
+
+    pp = &l->tab[_ldb_hash(key,klen) & (l->ntab-1)];
+    while(*pp!=NULL){
+        if((*pp)->keylen==klen && memcmp((*pp)->key,key,klen)==0) break;
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+//keydir项数超过哈希桶个数时将哈希表扩大一倍
+static void _ldb_rehash(LDB *l){
+    LENT **tab, *e, *next;
+    size_t ntab, i, h;
+
+    ntab = l->ntab*2;
+    if((tab = calloc(ntab,sizeof(LENT *)))==NULL) err_dump("_ldb_rehash: calloc error");
+    for(i=0;i<l->ntab;i++){
+        for(e=l->tab[i];e!=NULL;e=next){
+            next = e->next;
+            h = _ldb_hash(e->key,e->keylen) & (ntab-1);
+            e->next = tab[h];
+            tab[h] = e;
+        }
+    }
+    free(l->tab);
+    l->tab = tab;
+    l->ntab = ntab;
+
+    //项被重新链接到了新的哈希桶中，遍历从头开始，已经返回过的项靠mark跳过
+    l->scanb = 0;
+    l->scane = l->tab[0];
+}
+
+//二分查找id对应的段，返回其下标，找不到返回-1
+static int _ldb_findseg(LDB *l, unsigned int id){
+    int lo = 0, hi = l->nseg-1, mid;
+
+    while(lo<=hi){
+        mid = (lo+hi)/2;
+        if(l->seg[mid].id==id) return mid;
+        if(l->seg[mid].id<id) lo = mid+1;
+        else hi = mid-1;
+    }
+    return -1;
+}
+
+//将一个段加入段表(保持按id排序)，返回其下标
+static int _ldb_addseg(LDB *l, unsigned int id, int fd, off_t size){
+    int i;
+
+    if(l->nseg==l->maxseg){
+        l->maxseg = l->maxseg==0 ? 16 : l->maxseg*2;
+        if((l->seg = realloc(l->seg,l->maxseg*sizeof(LSEG)))==NULL) err_dump("_ldb_addseg: realloc error");
+    }
+    for(i=l->nseg;i>0 && l->seg[i-1].id>id;i--) l->seg[i] = l->seg[i-1];
+    l->seg[i].id = id;
+    l->seg[i].fd = fd;
+    l->seg[i].size = size;
+    l->seg[i].dead = 0;
+    l->nseg++;
+    l->totsize += size;
+    if(id>=l->nextid) l->nextid = id+1;
+    return i;
+}
+
+//段id中有len个字节的记录失效
+static void _ldb_dead(LDB *l, unsigned int id, off_t len){
+    int i;
+
+    if((i = _ldb_findseg(l,id))>=0){
+        l->seg[i].dead += len;
+        l->totdead += len;
+    }
+}
+
+//创建一个新的空段，返回其下标，调用者需要持有mtx
+static int _ldb_newseg(LDB *l){
+    char path[PATH_MAX];
+    unsigned int id;
+    int fd;
+
+    id = l->nextid;
+    _ldb_segname(path,l->name,id,"log");
+    if((fd = open(path,O_RDWR|O_CREAT|O_EXCL,l->mode))<0) err_sys("_ldb_newseg: open error for %s",path);
+    return _ldb_addseg(l,id,fd,0);
+}
+
+//在buf中组装一条记录，返回记录的长度
+static off_t _ldb_append(char *buf, unsigned long long seq,
+             const char *key, size_t klen, const char *val, unsigned int vlen)
+{
+    unsigned short k16 = klen;
+    unsigned int crc;
+    off_t reclen;
+
+    reclen = RECLEN(klen,vlen);
+    memcpy(buf+4,&seq,8);
+    memcpy(buf+12,&k16,2);
+    memcpy(buf+14,&vlen,4);
+    memcpy(buf+LREC_HDR,key,klen);
+    if(vlen!=LDB_TOMB) memcpy(buf+LREC_HDR+klen,val,vlen);
+    crc = _ldb_crc(buf+4,reclen-4);
+    memcpy(buf,&crc,4);
+    return reclen;
+}
+
+//恢复时应用一条记录(来自段或者hint)，seq较大的记录覆盖较小的记录
+static void _ldb_apply(LDB *l, unsigned long long seq, unsigned int seg, off_t off,
+             const char *key, size_t klen, unsigned int vlen)
+{
+    LENT **pp, *e;
+
+    if(seq>=l->seq) l->seq = seq+1;
+    pp = _ldb_lookup(l,key,klen);
+    if((e = *pp)!=NULL){
+        if(e->seq>seq){
+            //这条记录比keydir中的旧，直接作废
+            _ldb_dead(l,seg,RECLEN(klen,vlen));
+            return;
+        }
+        //被覆盖的删除标记在应用时已经算作失效数据了，不能再算一次
+        if(e->vallen!=LDB_TOMB) _ldb_dead(l,e->seg,RECLEN(e->keylen,e->vallen));
+    }else{
+        if((e = malloc(sizeof(LENT)+klen))==NULL) err_dump("_ldb_apply: malloc error");
+        memcpy(e->key,key,klen);
+        e->keylen = klen;
+        e->mark = 0;
+        e->next = NULL;
+        *pp = e;
+        l->nent++;
+    }
+    e->seq = seq;
+    e->seg = seg;
+    e->off = off;
+    e->vallen = vlen;
+    if(vlen==LDB_TOMB) _ldb_dead(l,seg,RECLEN(klen,vlen));  //删除标记本身也是失效数据
+    if(l->nent>l->ntab) _ldb_rehash(l);
+}
+
+//顺序扫描一个段，将其中的记录应用到keydir中
+//遇到不完整或者校验失败的记录(写到一半时崩溃)就停止，之后的内容都视为失效数据
+static int _ldb_scanseg(LDB *l, unsigned int id, int fd, off_t size){
+    char *map;
+    off_t off;
+    unsigned long long seq;
+    unsigned short klen;
+    unsigned int vlen, crc;
+    off_t reclen;
+
+    if(size==0) return 0;
+    if((map = mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0))==MAP_FAILED) return -1;
+    for(off=0;off+LREC_HDR<=size;off+=reclen){
+        memcpy(&crc,map+off,4);
+        memcpy(&seq,map+off+4,8);
+        memcpy(&klen,map+off+12,2);
+        memcpy(&vlen,map+off+14,4);
+        reclen = RECLEN(klen,vlen);
+        if(off+reclen>size || crc!=_ldb_crc(map+off+4,reclen-4)) break;
+        _ldb_apply(l,seq,id,off,map+off+LREC_HDR,klen,vlen);
+    }
+    if(off<size) _ldb_dead(l,id,size-off);
+    munmap(map,size);
+    return 0;
+}
+
+//从hint文件中恢复一个段的keydir，hint文件不存在时返回-1
+static int _ldb_loadhint(LDB *l, unsigned int id, const char *path){
+    struct stat statbuff;
+    char *map, *p;
+    unsigned long long seq;
+    off_t off;
+    unsigned int vlen;
+    unsigned short klen;
+    int fd;
+
+    if((fd = open(path,O_RDONLY))<0) return -1;
+    if(fstat(fd,&statbuff)<0) err_dump("_ldb_loadhint: fstat error");
+    if(statbuff.st_size>0){
+        if((map = mmap(NULL,statbuff.st_size,PROT_READ,MAP_SHARED,fd,0))==MAP_FAILED){
+            close(fd);
+            return -1;
+        }
+        for(p=map;p+LHINT_HDR<=map+statbuff.st_size;p+=LHINT_HDR+klen){
+            memcpy(&seq,p,8);
+            memcpy(&off,p+8,8);
+            memcpy(&vlen,p+16,4);
+            memcpy(&klen,p+20,2);
+            _ldb_apply(l,seq,id,off,p+LHINT_HDR,klen,vlen);
+        }
+        munmap(map,statbuff.st_size);
+    }
+    close(fd);
+    return 0;
+}
+
+//不可变段(活跃段以外的段)中失效数据足够多时需要合并
+static int _ldb_needmerge(LDB *l){
+    off_t immsize, immdead;
+    int i;
+
+    if((i = _ldb_findseg(l,l->activeid))<0) return 0;
+    immsize = l->totsize - l->seg[i].size;
+    immdead = l->totdead - l->seg[i].dead;
+    return immdead>=LDB_MERGEMIN && immdead*2>=immsize;
+}
+
+//合并输出段写完后，先将段刷到磁盘，再写出它的hint文件
+//hint文件先写到临时文件再改名，因此存在的hint文件一定是完整的
+static void _ldb_writehint(LDB *l, unsigned int id, int segfd, const char *hint, size_t len){
+    char path[PATH_MAX], tmp[PATH_MAX+4];
+    int fd;
+
+    if(fsync(segfd)<0) err_sys("_ldb_writehint: fsync error");
+    _ldb_segname(path,l->name,id,"hint");
+    snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    if((fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,l->mode))<0 ||
+      write(fd,hint,len)!=len || fsync(fd)<0 || close(fd)<0 ||
+      rename(tmp,path)<0)
+        err_sys("_ldb_writehint: write error for %s",path);
+}
+
+//写出合并清单，清单存在之后旧段才能开始删除
+static void _ldb_writemanifest(LDB *l, unsigned int *ids, int n){
+    char path[PATH_MAX], tmp[PATH_MAX+4];
+    size_t len = n*sizeof(unsigned int);
+    int fd;
+
+    snprintf(path,sizeof(path),"%s.merge",l->name);
+    snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    if((fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,l->mode))<0 ||
+      write(fd,ids,len)!=len || fsync(fd)<0 || close(fd)<0 ||
+      rename(tmp,path)<0)
+        err_sys("_ldb_writemanifest: write error for %s",path);
+    _ldb_syncdir(l->name);     //同时保证之前输出段的hint已经改名完成
+}
+
+//合并完成后关闭并删除旧段，清单保证崩溃时这些段要么全部保留要么全部删除
+static void _ldb_reclaim(LDB *l, unsigned int *ids, int n){
+    char path[PATH_MAX];
+    int i, j;
+
+    _ldb_writemanifest(l,ids,n);
+    pthread_mutex_lock(&l->mtx);
+    for(i=0;i<n;i++){
+        if((j = _ldb_findseg(l,ids[i]))<0) continue;
+        close(l->seg[j].fd);
+        l->totsize -= l->seg[j].size;
+        l->totdead -= l->seg[j].dead;
+        memmove(&l->seg[j],&l->seg[j+1],(l->nseg-j-1)*sizeof(LSEG));
+        l->nseg--;
+        _ldb_segname(path,l->name,ids[i],"log");
+        unlink(path);
+        _ldb_segname(path,l->name,ids[i],"hint");
+        unlink(path);
+    }
+    _ldb_syncdir(l->name);
+    snprintf(path,sizeof(path),"%s.merge",l->name);
+    unlink(path);
+    l->cnt_merge++;
+    pthread_mutex_unlock(&l->mtx);
+}
+
+/*
+ * 合并所有不可变段：把其中keydir仍然指向的记录复制到新段中，同时生成hint文件。
+ * 只有复制和keydir的切换需要持有mtx，读取旧段和写新段都在锁外进行，
+ * 因此合并期间前台的读写基本不受影响。
+ */
+static void _ldb_merge(LDB *l){
+    unsigned int *ids, outid = 0;
+    char *map, *hint = NULL;
+    size_t hintlen = 0, hintmax = 0;
+    int n, i, j, fd, outfd = -1, live;
+    off_t size, off, reclen, outoff = 0;
+    unsigned long long seq;
+    unsigned short klen;
+    unsigned int vlen, crc;
+    LENT *e;
+
+    //记录下此刻所有的不可变段，合并期间新产生的段不参与这次合并
+    pthread_mutex_lock(&l->mtx);
+    if((ids = malloc(l->nseg*sizeof(unsigned int)))==NULL) err_dump("_ldb_merge: malloc error");
+    for(n=0,i=0;i<l->nseg;i++){
+        if(l->seg[i].id!=l->activeid) ids[n++] = l->seg[i].id;
+    }
+    pthread_mutex_unlock(&l->mtx);
+
+    for(i=0;i<n;i++){
+        //只有合并线程会关闭段，因此在锁外使用fd是安全的
+        pthread_mutex_lock(&l->mtx);
+        j = _ldb_findseg(l,ids[i]);
+        fd = l->seg[j].fd;
+        size = l->seg[j].size;
+        pthread_mutex_unlock(&l->mtx);
+        if(size==0) continue;
+        if((map = mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0))==MAP_FAILED) err_sys("_ldb_merge: mmap error");
+
+        for(off=0;off+LREC_HDR<=size;off+=reclen){
+            memcpy(&crc,map+off,4);
+            memcpy(&seq,map+off+4,8);
+            memcpy(&klen,map+off+12,2);
+            memcpy(&vlen,map+off+14,4);
+            reclen = RECLEN(klen,vlen);
+            if(off+reclen>size || crc!=_ldb_crc(map+off+4,reclen-4)) break;
+            //所有更早的记录都在本次合并的段中，清单保证它们和删除标记一起删除，删除标记可以丢弃
+            if(vlen==LDB_TOMB) continue;
+
+            pthread_mutex_lock(&l->mtx);
+            e = *_ldb_lookup(l,map+off+LREC_HDR,klen);
+            live = e!=NULL && e->seg==ids[i] && e->off==off;
+            pthread_mutex_unlock(&l->mtx);
+            if(!live) continue;
+
+            //输出段写满后换一个新的输出段
+            if(outfd<0 || outoff+reclen>LDB_SEGMAX){
+                if(outfd>=0) _ldb_writehint(l,outid,outfd,hint,hintlen);
+                pthread_mutex_lock(&l->mtx);
+                j = _ldb_newseg(l);
+                outid = l->seg[j].id;
+                outfd = l->seg[j].fd;
+                pthread_mutex_unlock(&l->mtx);
+                outoff = 0;
+                hintlen = 0;
+            }
+
+            //记录原样复制，seq保持不变
+            if(pwrite(outfd,map+off,reclen,outoff)!=reclen) err_sys("_ldb_merge: pwrite error");
+            if(hintlen+LHINT_HDR+klen>hintmax){
+                hintmax = hintmax==0 ? 65536 : hintmax*2;
+                if((hint = realloc(hint,hintmax))==NULL) err_dump("_ldb_merge: realloc error");
+            }
+            memcpy(hint+hintlen,&seq,8);
+            memcpy(hint+hintlen+8,&outoff,8);
+            memcpy(hint+hintlen+16,&vlen,4);
+            memcpy(hint+hintlen+20,&klen,2);
+            memcpy(hint+hintlen+LHINT_HDR,map+off+LREC_HDR,klen);
+            hintlen += LHINT_HDR+klen;
+
+            //复制期间前台可能已经更新或者删除了这个键，此时新复制的记录直接作废
+            pthread_mutex_lock(&l->mtx);
+            j = _ldb_findseg(l,outid);
+            l->seg[j].size += reclen;
+            l->totsize += reclen;
+            e = *_ldb_lookup(l,map+off+LREC_HDR,klen);
+            if(e!=NULL && e->seg==ids[i] && e->off==off){
+                e->seg = outid;
+                e->off = outoff;
+            }else{
+                _ldb_dead(l,outid,reclen);
+            }
+            pthread_mutex_unlock(&l->mtx);
+            outoff += reclen;
+        }
+        munmap(map,size);
+    }
+
+    if(outfd>=0) _ldb_writehint(l,outid,outfd,hint,hintlen);
+    _ldb_reclaim(l,ids,n);
+    free(hint);
+    free(ids);
+}
+
+//后台合并线程
+static void *_ldb_mergethread(void *arg){
+    LDB *l = arg;
+
+    pthread_mutex_lock(&l->mtx);
+    while(!l->stop){
+        if(!_ldb_needmerge(l)){
+            pthread_cond_wait(&l->cond,&l->mtx);
+            continue;
+        }
+        pthread_mutex_unlock(&l->mtx);
+        _ldb_merge(l);
+        pthread_mutex_lock(&l->mtx);
+    }
+    pthread_mutex_unlock(&l->mtx);
+    return NULL;
+}
+
+static void _ldb_free(LDB *l){
+    LENT *e, *next;
+    size_t i;
+    int j;
+
+    if(l->tab!=NULL){
+        for(i=0;i<l->ntab;i++){
+            for(e=l->tab[i];e!=NULL;e=next){
+                next = e->next;
+                free(e);
+            }
+        }
+        free(l->tab);
+    }
+    for(j=0;j<l->nseg;j++) close(l->seg[j].fd);
+    free(l->seg);
+    if(l->lockfd>=0) close(l->lockfd);
+    free(l->recbuf);
+    free(l->databuf);
+    free(l->name);
+    pthread_mutex_destroy(&l->mtx);
+    pthread_cond_destroy(&l->cond);
+    free(l);
+}
+
+//打开一个日志引擎分片，flags和mode的含义与系统调用open相同
+//日志引擎只允许一个进程打开，本来就不使用fcntl记录锁，opt中的DB_NOLOCK对它没有影响
+void *ldb_open(const char *name, int flags, int mode, const DBOPT *opt){
+    LDB *l;
+    char path[PATH_MAX];
+    unsigned int *ids, *gone;
+    struct stat statbuff;
+    LENT **pp, *e;
+    size_t i;
+    int n, ngone, j, k, fd;
+
+    pthread_once(&crconce,_ldb_crcinit);
+
+    if((l = calloc(1,sizeof(LDB)))==NULL) err_dump("ldb_open calloc error");
+    l->lockfd = -1;
+    l->nextid = 1;
+    pthread_mutex_init(&l->mtx,NULL);
+    pthread_cond_init(&l->cond,NULL);
+    if((l->name = strdup(name))==NULL) err_dump("ldb_open strdup error");
+    l->recbuf = malloc(LREC_HDR+IDXLEN_MAX+DATLEN_MAX);
+    l->databuf = malloc(DATLEN_MAX+1);
+    l->ntab = LDB_NTAB_DEF;
+    l->tab = calloc(l->ntab,sizeof(LENT *));
+    if(l->recbuf==NULL || l->databuf==NULL || l->tab==NULL) err_dump("ldb_open malloc error");
+    l->rdonly = (flags & O_ACCMODE)==O_RDONLY;
+
+    //锁文件保证同一时间只有一个进程以读写方式打开(keydir只存在于这个进程的内存中)
+    snprintf(path,sizeof(path),"%s.lck",name);
+    if((l->lockfd = open(path,(l->rdonly?O_RDONLY:O_RDWR)|(flags&O_CREAT),mode))<0) goto errout;
+    if((l->rdonly ? read_lock(l->lockfd,0,SEEK_SET,0) : write_lock(l->lockfd,0,SEEK_SET,0))<0) goto errout;
+
+    //新建段使用和锁文件相同的权限
+    if(fstat(l->lockfd,&statbuff)<0) err_dump("ldb_open fstat error");
+    l->mode = statbuff.st_mode & 0777;
+
+    n = _ldb_listsegs(name,&ids);
+
+    //上一次合并删除旧段时崩溃，清单中剩下的段不再使用，读写打开时把它们删完
+    ngone = _ldb_readmanifest(name,&gone);
+    for(j=0,k=0;j<n;j++){
+        for(i=0;i<ngone && gone[i]!=ids[j];i++) ;
+        if(i==ngone) ids[k++] = ids[j];
+    }
+    n = k;
+    if(ngone>0 && !l->rdonly){
+        for(i=0;i<ngone;i++){
+            _ldb_segname(path,name,gone[i],"log");
+            unlink(path);
+            _ldb_segname(path,name,gone[i],"hint");
+            unlink(path);
+        }
+        _ldb_syncdir(name);
+        snprintf(path,sizeof(path),"%s.merge",name);
+        unlink(path);
+    }
+    free(gone);
+
+    if(!l->rdonly && (flags & O_TRUNC)){
+        for(j=0;j<n;j++){
+            _ldb_segname(path,name,ids[j],"log");
+            unlink(path);
+            _ldb_segname(path,name,ids[j],"hint");
+            unlink(path);
+        }
+        n = 0;
+    }
+    if(n==0 && !(flags & O_CREAT)){
+        free(ids);
+        errno = ENOENT;
+        goto errout;
+    }
+
+    //依次恢复每个段，有hint文件的段直接读取hint
+    for(j=0;j<n;j++){
+        _ldb_segname(path,name,ids[j],"log");
+        if((fd = open(path,O_RDONLY))<0 || fstat(fd,&statbuff)<0) err_sys("ldb_open: open error for %s",path);
+        _ldb_addseg(l,ids[j],fd,statbuff.st_size);
+        _ldb_segname(path,name,ids[j],"hint");
+        if(_ldb_loadhint(l,ids[j],path)<0 && _ldb_scanseg(l,ids[j],fd,statbuff.st_size)<0)
+            err_sys("ldb_open: scan error for segment %u",ids[j]);
+    }
+    free(ids);
+
+    //恢复结束后，keydir中的删除标记已经没有用了
+    for(i=0;i<l->ntab;i++){
+        for(pp=&l->tab[i];(e = *pp)!=NULL;){
+            if(e->vallen==LDB_TOMB){
+                *pp = e->next;
+                free(e);
+                l->nent--;
+            }else{
+                pp = &e->next;
+            }
+        }
+    }
+
+    if(!l->rdonly){
+        j = _ldb_newseg(l);
+        l->activeid = l->seg[j].id;
+        if(pthread_create(&l->tid,NULL,_ldb_mergethread,l)!=0) err_dump("ldb_open pthread_create error");
+        l->hasthread = 1;
+    }
+    ldb_rewind(l);
+    return l;
+
+errout:
+    _ldb_free(l);
+    return NULL;
+}
+
+void ldb_close(void *h){
+    LDB *l = h;
+    char path[PATH_MAX];
+    int i;
+
+    if(l->hasthread){
+        pthread_mutex_lock(&l->mtx);
+        l->stop = 1;
+        pthread_cond_signal(&l->cond);
+        pthread_mutex_unlock(&l->mtx);
+        pthread_join(l->tid,NULL);
+    }
+    //没有写入任何内容的活跃段直接删除
+    if(l->activeid!=0 && (i = _ldb_findseg(l,l->activeid))>=0 && l->seg[i].size==0){
+        _ldb_segname(path,l->name,l->activeid,"log");
+        unlink(path);
+    }
+    _ldb_free(l);
+}
+
+//读取keydir项e对应的值到databuf中，调用者需要持有mtx
+static char *_ldb_readval(LDB *l, LENT *e){
+    int i;
+
+    if((i = _ldb_findseg(l,e->seg))<0) err_dump("ldb: missing segment %u",e->seg);
+    if(pread(l->seg[i].fd,l->databuf,e->vallen,e->off+LREC_HDR+e->keylen)!=e->vallen)
+        err_sys("ldb: pread error");
+    l->databuf[e->vallen] = 0;
+    return l->databuf;
+}
+
+char *ldb_fetch(void *h, const char *key, size_t *datlen){
+    LDB *l = h;
+    LENT *e;
+    char *ptr = NULL;
+
+    pthread_mutex_lock(&l->mtx);
+    if((e = *_ldb_lookup(l,key,strlen(key)))!=NULL){
+        ptr = _ldb_readval(l,e);
+        if(datlen!=NULL) *datlen = e->vallen;
+        l->cnt_fetchok++;
+    }else{
+        l->cnt_fetcherr++;
+    }
+    pthread_mutex_unlock(&l->mtx);
+    return ptr;
+}
+
+//向活跃段追加一条记录，活跃段写满时先换一个新的活跃段，返回记录的偏移量，调用者需要持有mtx
+static off_t _ldb_put(LDB *l, const char *key, size_t klen, const char *val, unsigned int vlen){
+    off_t reclen, off;
+    int i;
+
+    reclen = RECLEN(klen,vlen);
+    i = _ldb_findseg(l,l->activeid);
+    if(l->seg[i].size>0 && l->seg[i].size+reclen>LDB_SEGMAX){
+        i = _ldb_newseg(l);
+        l->activeid = l->seg[i].id;
+    }
+    _ldb_append(l->recbuf,l->seq,key,klen,val,vlen);
+    off = l->seg[i].size;
+    if(pwrite(l->seg[i].fd,l->recbuf,reclen,off)!=reclen) err_sys("ldb: pwrite error");
+    l->seg[i].size += reclen;
+    l->totsize += reclen;
+    l->seq++;
+    return off;
+}
+
+int ldb_store(void *h, const char *key, const char *data, int flag){
+    LDB *l = h;
+    LENT **pp, *e;
+    size_t klen, dlen;
+    off_t off;
+
+    if(flag!=DB_INSERT && flag!=DB_REPLACE && flag!=DB_STORE){
+        errno = EINVAL;
+        return -1;
+    }
+    klen = strlen(key);
+    dlen = strlen(data);
+    if(l->rdonly || klen==0 || klen>=IDXLEN_MAX || dlen+1<DATLEN_MIN || dlen+1>DATLEN_MAX){
+        errno = l->rdonly ? EBADF : EINVAL;
+        l->cnt_storerr++;
+        return -1;
+    }
+
+    pthread_mutex_lock(&l->mtx);
+    pp = _ldb_lookup(l,key,klen);
+    if((*pp==NULL && flag==DB_REPLACE) || (*pp!=NULL && flag==DB_INSERT)){
+        errno = *pp==NULL ? ENOENT : EEXIST;
+        l->cnt_storerr++;
+        pthread_mutex_unlock(&l->mtx);
+        return -1;
+    }
+
+    off = _ldb_put(l,key,klen,data,dlen);
+    if((e = *pp)!=NULL){
+        //旧记录失效
+        _ldb_dead(l,e->seg,RECLEN(e->keylen,e->vallen));
+        l->cnt_stor4++;
+    }else{
+        if((e = malloc(sizeof(LENT)+klen))==NULL) err_dump("ldb_store: malloc error");
+        memcpy(e->key,key,klen);
+        e->keylen = klen;
+        e->mark = 0;
+        e->next = NULL;
+        *pp = e;
+        l->nent++;
+        l->cnt_stor1++;
+    }
+    e->seq = l->seq-1;
+    e->seg = l->activeid;
+    e->off = off;
+    e->vallen = dlen;
+    if(l->nent>l->ntab) _ldb_rehash(l);
+    if(_ldb_needmerge(l)) pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->mtx);
+    return 1;
+}
+
+int ldb_delete(void *h, const char *key){
+    LDB *l = h;
+    LENT **pp, *e;
+    size_t klen;
+    int rc = -1;
+
+    klen = strlen(key);
+    pthread_mutex_lock(&l->mtx);
+    pp = _ldb_lookup(l,key,klen);
+    if((e = *pp)!=NULL && !l->rdonly){
+        //追加删除标记，删除标记和旧记录都失效
+        _ldb_put(l,key,klen,NULL,LDB_TOMB);
+        _ldb_dead(l,l->activeid,RECLEN(klen,LDB_TOMB));
+        _ldb_dead(l,e->seg,RECLEN(e->keylen,e->vallen));
+        if(l->scane==e) l->scane = e->next;   //遍历的游标不能指向已经释放的项
+        *pp = e->next;
+        free(e);
+        l->nent--;
+        l->cnt_delok++;
+        rc = 0;
+        if(_ldb_needmerge(l)) pthread_cond_signal(&l->cond);
+    }else{
+        l->cnt_delerr++;
+    }
+    pthread_mutex_unlock(&l->mtx);
+    return rc;
+}
+
+void ldb_rewind(void *h){
+    LDB *l = h;
+
+    pthread_mutex_lock(&l->mtx);
+    l->scanb = 0;
+    l->scane = l->tab[0];
+    if(++l->scanepoch==0) l->scanepoch = 1;    //0是新项的mark
+    pthread_mutex_unlock(&l->mtx);
+}
+
+//按照keydir的顺序遍历所有键，每个键最多返回一次
+//遍历期间删除键是安全的；遍历期间插入的新键可能返回也可能不返回
+char *ldb_nextrec(void *h, char *key){
+    LDB *l = h;
+    LENT *e;
+    char *ptr = NULL;
+
+    pthread_mutex_lock(&l->mtx);
+    for(;;){
+        while(l->scane==NULL && ++l->scanb<l->ntab) l->scane = l->tab[l->scanb];
+        if((e = l->scane)==NULL) break;
+        l->scane = e->next;
+        if(e->mark==l->scanepoch) continue;     //扩容后重新遍历时已经返回过
+        e->mark = l->scanepoch;
+        if(key!=NULL){
+            memcpy(key,e->key,e->keylen);
+            key[e->keylen] = 0;
+        }
+        ptr = _ldb_readval(l,e);
+        l->cnt_nextrec++;
+        break;
+    }
+    pthread_mutex_unlock(&l->mtx);
+    return ptr;
+}
+
+void ldb_stats(void *h, DBSTAT *st){
+    LDB *l = h;
+
+    pthread_mutex_lock(&l->mtx);
+    st->delok    += l->cnt_delok;
+    st->delerr   += l->cnt_delerr;
+    st->fetchok  += l->cnt_fetchok;
+    st->fetcherr += l->cnt_fetcherr;
+    st->nextrec  += l->cnt_nextrec;
+    st->stor1    += l->cnt_stor1;
+    st->stor4    += l->cnt_stor4;
+    st->storerr  += l->cnt_storerr;
+    st->merges   += l->cnt_merge;
+    pthread_mutex_unlock(&l->mtx);
+}
+
+const DBENGINE ldb_engine = {
+    ldb_exists, ldb_remove, ldb_open, ldb_close, ldb_fetch, ldb_store,
+    ldb_delete, ldb_rewind, ldb_nextrec, ldb_stats,
+    NULL    /* keydir lookups don't walk chains, nothing to reorder */
+};
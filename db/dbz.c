@@ -0,0 +1,196 @@
+#include "dbint.h"
+#include "apue.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * 数据记录的压缩编码，供哈希引擎的_db_writedat/_db_readdat使用。
+ *
+ * DBZ_LZ是内置的LZ77编码(与LZF的格式相同)，不依赖任何库，速度优先：
+ *     控制字节 c < 32        : 后面跟c+1个字面字节
+ *     控制字节 c >= 32       : 回溯引用，长度为(c>>5)+2，长度字段为7时再加上下一个字节的值，
+ *                              再下一个字节与c的低5位组成13位的距离(距离-1)
+ * DBZ_ZLIB是raw deflate，只有编译时找到zlib才可用。
+ *
+ * 所有函数都在输出放不下时返回0，压缩的调用者据此判断压缩不划算。
+ */
+
+#define LZ_HLOG		10	/* hash table size (log2) */
+#define LZ_HSIZE	(1 << LZ_HLOG)
+#define LZ_MAXLIT	32	/* max literal run */
+#define LZ_MAXOFF	8192	/* max back-reference distance */
+#define LZ_MAXREF	(2 + 7 + 255)	/* max back-reference length */
+
+#define LZ_HASH(p) \
+	(((((unsigned int)(p)[0] << 16) | ((p)[1] << 8) | (p)[2]) * 2654435761U) >> (32 - LZ_HLOG))
+
+#ifdef HAVE_ZLIB
+#define ZLIB_WBITS	10	/* records are at most DATLEN_MAX bytes, a 1K window is enough */
+#define ZLIB_MEMLEVEL	4
+#endif
+
+struct dbz{
+#ifdef HAVE_ZLIB
+    z_stream def;       //压缩流，第一次使用时初始化，之后每条记录reset
+    int      definit;
+    z_stream inf;       //解压流
+    int      infinit;
+#endif
+    int      unused;    //没有zlib时结构体不能为空
+};
+
+static size_t _dbz_lzcompress(const unsigned char *, size_t, unsigned char *, size_t);
+static size_t _dbz_lzdecompress(const unsigned char *, size_t, unsigned char *, size_t);
+
+//刷新in[ip-lit, ip)这段字面字节
+#define LZ_FLUSHLIT() do{ \
+        if(lit>0){ \
+            if(op+1+lit>outmax) return 0; \
+            out[op++] = lit-1; \
+            memcpy(out+op,in+ip-lit,lit); \
+            op += lit; \
+            lit = 0; \
+        } \
+    }while(0)
+
+static size_t _dbz_lzcompress(const unsigned char *in, size_t inlen, unsigned char *out, size_t outmax){
+    unsigned int htab[LZ_HSIZE];    //三字节前缀最近一次出现的位置+1，0表示没有
+    size_t ip = 0, op = 0, lit = 0, ref, off, len, maxlen;
+    unsigned int h;
+
+    memset(htab,0,sizeof(htab));
+    while(ip+2<inlen){
+        h = LZ_HASH(in+ip);
+        ref = htab[h];
+        htab[h] = ip+1;
+        if(ref!=0 && (off = ip-ref)<LZ_MAXOFF && memcmp(in+ref-1,in+ip,3)==0){
+            ref--;
+            maxlen = inlen-ip;
+            if(maxlen>LZ_MAXREF) maxlen = LZ_MAXREF;
+            for(len=3;len<maxlen && in[ref+len]==in[ip+len];len++);
+
+            LZ_FLUSHLIT();
+            if(op+3>outmax) return 0;
+            ip += len;
+            len -= 2;
+            if(len<7){
+                out[op++] = (len<<5) | (off>>8);
+            }else{
+                out[op++] = (7<<5) | (off>>8);
+                out[op++] = len-7;
+            }
+            out[op++] = off & 0xff;
+        }else{
+            ip++;
+            if(++lit==LZ_MAXLIT) LZ_FLUSHLIT();
+        }
+    }
+    //剩下不足三个字节，只能作为字面字节
+    while(ip<inlen){
+        ip++;
+        if(++lit==LZ_MAXLIT) LZ_FLUSHLIT();
+    }
+    LZ_FLUSHLIT();
+    return op;
+}
+
+//输入不合法(记录损坏)时返回0
+static size_t _dbz_lzdecompress(const unsigned char *in, size_t inlen, unsigned char *out, size_t outmax){
+    size_t ip = 0, op = 0, len, dist;
+    unsigned int c;
+
+    while(ip<inlen){
+        c = in[ip++];
+        if(c<LZ_MAXLIT){
+            len = c+1;
+            if(ip+len>inlen || op+len>outmax) return 0;
+            memcpy(out+op,in+ip,len);
+            ip += len;
+            op += len;
+        }else{
+            len = c>>5;
+            if(len==7){
+                if(ip>=inlen) return 0;
+                len += in[ip++];
+            }
+            if(ip>=inlen) return 0;
+            dist = ((c & 0x1f)<<8) + in[ip++] + 1;
+            len += 2;
+            if(dist>op || op+len>outmax) return 0;
+            //引用可能与输出重叠，只能逐字节拷贝
+            for(;len>0;len--,op++) out[op] = out[op-dist];
+        }
+    }
+    return op;
+}
+
+//判断codec在这次编译中是否可用
+int dbz_available(int codec){
+#ifdef HAVE_ZLIB
+    if(codec==DBZ_ZLIB) return 1;
+#endif
+    return codec==DBZ_LZ;
+}
+
+DBZ *dbz_alloc(void){
+    DBZ *z;
+
+    if((z = calloc(1,sizeof(DBZ)))==NULL) err_dump("dbz_alloc calloc error");
+    return z;
+}
+
+void dbz_free(DBZ *z){
+    if(z==NULL) return;
+#ifdef HAVE_ZLIB
+    if(z->definit) deflateEnd(&z->def);
+    if(z->infinit) inflateEnd(&z->inf);
+#endif
+    free(z);
+}
+
+//压缩in，结果放不进outmax个字节时返回0
+size_t dbz_compress(DBZ *z, int codec, const char *in, size_t inlen, char *out, size_t outmax){
+#ifdef HAVE_ZLIB
+    if(codec==DBZ_ZLIB){
+        if(!z->definit){
+            if(deflateInit2(&z->def,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-ZLIB_WBITS,ZLIB_MEMLEVEL,
+              Z_DEFAULT_STRATEGY)!=Z_OK) err_dump("dbz_compress: deflateInit2 error");
+            z->definit = 1;
+        }else if(deflateReset(&z->def)!=Z_OK){
+            err_dump("dbz_compress: deflateReset error");
+        }
+        z->def.next_in = (unsigned char *)in;
+        z->def.avail_in = inlen;
+        z->def.next_out = (unsigned char *)out;
+        z->def.avail_out = outmax;
+        if(deflate(&z->def,Z_FINISH)!=Z_STREAM_END) return 0;
+        return outmax-z->def.avail_out;
+    }
+#endif
+    if(codec!=DBZ_LZ) err_dump("dbz_compress: unsupported codec %c",codec);
+    return _dbz_lzcompress((const unsigned char *)in,inlen,(unsigned char *)out,outmax);
+}
+
+//解压in，记录损坏或者解压结果超过outmax时返回0
+size_t dbz_decompress(DBZ *z, int codec, const char *in, size_t inlen, char *out, size_t outmax){
+#ifdef HAVE_ZLIB
+    if(codec==DBZ_ZLIB){
+        if(!z->infinit){
+            if(inflateInit2(&z->inf,-ZLIB_WBITS)!=Z_OK) err_dump("dbz_decompress: inflateInit2 error");
+            z->infinit = 1;
+        }else if(inflateReset(&z->inf)!=Z_OK){
+            err_dump("dbz_decompress: inflateReset error");
+        }
+        z->inf.next_in = (unsigned char *)in;
+        z->inf.avail_in = inlen;
+        z->inf.next_out = (unsigned char *)out;
+        z->inf.avail_out = outmax;
+        if(inflate(&z->inf,Z_FINISH)!=Z_STREAM_END) return 0;
+        return outmax-z->inf.avail_out;
+    }
+#endif
+    if(codec!=DBZ_LZ) return 0;
+    return _dbz_lzdecompress((const unsigned char *)in,inlen,(unsigned char *)out,outmax);
+}
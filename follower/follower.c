@@ -0,0 +1,205 @@
+#include "apue.h"
+#include "db.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>	/* PATH_MAX */
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/time.h>
+
+/*
+ * simpledb-follower：跟随主库的变更日志(DBOPT.changelog / simpledb-server -l)，
+ * 把每条store/delete回放到一个独立的idx/dat副本上，查询流量可以转到副本，不再占用主库的锁和I/O。
+ * 多开几个follower(可以放在不同的磁盘上)就能线性增加读能力。
+ *
+ * 回放时照常加链锁，查询进程可以在回放进行的同时以O_RDONLY打开副本读取，
+ * 这些锁只会和副本的读者竞争，与主库无关。
+ * 如果回放期间没有任何进程打开副本(例如先追上日志再对外提供查询)，可以用-n以DB_NOLOCK打开副本，
+ * 省去每条记录的fcntl系统调用；此时同时读取副本的进程可能读到写了一半的记录。
+ *
+ * 回放进度保存在 <replica>.pos 中，格式为一行定宽文本：
+ *     <已回放到的日志偏移> <落后的字节数> <落后的秒数>
+ * 重启后从该偏移继续。偏移在回放之后才写入，崩溃后可能重放少量记录，
+ * 但store都是整条覆盖、删除不存在的键会被忽略，重放是幂等的。
+ * 同一个副本只能有一个follower，用pos文件上的写锁保证。
+ */
+
+#define BUF_SZ		65536	/* change log read buffer */
+#define LOGHDR_MAX	64	/* max record header length, see dbapi.c */
+#define REPORT_DEF	10	/* default lag report interval (s) */
+#define POSLINE_SZ	56	/* fixed width of the .pos line */
+
+int log_to_stderr = 1;  //apue的log_*函数使用
+
+static DBHANDLE     db;
+static int          posfd;
+static off_t        applied;    //已经回放到的日志偏移
+static long long    lastts;     //最后一条已回放记录的时间戳(微秒)，0表示本次启动还没有回放过
+static unsigned long napplied;  //本次启动回放的记录数
+static unsigned long nfailed;   //副本拒绝的store(例如哈希引擎不接受的键)
+static volatile sig_atomic_t quitflag;
+
+static void sig_quit(int signo){
+    quitflag = 1;
+}
+
+static long long now_usec(void){
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (long long)tv.tv_sec*1000000+tv.tv_usec;
+}
+
+//根据当前日志长度计算落后的字节数和秒数
+//秒数按最后一条已回放记录的时间估算，是实际延迟的上界；已经追上时为0
+static void lag(off_t logsize, long long *lagbytes, double *lagsec){
+    *lagbytes = logsize>applied ? (long long)(logsize-applied) : 0;
+    if(*lagbytes==0) *lagsec = 0;
+    else if(lastts==0) *lagsec = -1;    //还不知道
+    else *lagsec = (now_usec()-lastts)/1e6;
+}
+
+//把回放进度和延迟写入pos文件
+static void savepos(off_t logsize){
+    char line[POSLINE_SZ+1];
+    long long lagbytes;
+    double lagsec;
+
+    lag(logsize,&lagbytes,&lagsec);
+    snprintf(line,sizeof(line),"%20lld %20lld %13.3f\n",(long long)applied,lagbytes,lagsec);
+    if(pwrite(posfd,line,POSLINE_SZ,0)!=POSLINE_SZ) log_sys("can't write position file");
+}
+
+//回放buf中所有完整的记录，返回消耗的字节数，末尾不完整的记录留到下一次
+//buf[len]必须是\0，保证sscanf不会越界
+static size_t apply(char *buf, size_t len){
+    char *p = buf, *end = buf+len, *nl, *key;
+    long long ts;
+    size_t klen, vlen, need;
+    char op;
+    int rc;
+
+    while(p<end){
+        if((nl = memchr(p,'\n',end-p))==NULL){
+            if(end-p>LOGHDR_MAX) break;     //交给下面的检查报告
+            return p-buf;
+        }
+        if(nl-p>LOGHDR_MAX || sscanf(p,"%c %lld %zu %zu",&op,&ts,&klen,&vlen)!=4
+          || (op!='S' && op!='D') || klen>IDXLEN_MAX || vlen>=DATLEN_MAX) break;
+        need = nl+1-p+klen+vlen+1;
+        if(end-p<need) return p-buf;
+        if(p[need-1]!='\n') break;
+
+        key = nl+1;
+        if(op=='S'){
+            if((rc = db_storen(db,key,klen,key+klen,vlen,DB_STORE))<0){
+                log_ret("can't apply store of key %.*s at offset %lld",(int)klen,key,(long long)(applied+(p-buf)));
+                nfailed++;
+            }
+        }else{
+            db_deleten(db,key,klen);    //键不存在说明这条删除已经回放过
+        }
+        lastts = ts;
+        napplied++;
+        p += need;
+    }
+    if(p<end) log_quit("corrupt change log at offset %lld",(long long)(applied+(p-buf)));
+    return p-buf;
+}
+
+static void usage(void){
+    err_quit("usage: simpledb-follower [-s nshard] [-p interval_ms] [-r report_secs] [-n] changelog replica");
+}
+
+int main(int argc, char *argv[]){
+    DBOPT opt = {0, DB_ENGINE_HASH, 0, NULL};
+    char path[PATH_MAX], line[POSLINE_SZ+1], *buf;
+    struct stat statbuff;
+    struct sigaction sa;
+    struct pollfd pfd;
+    long long lastreport, lagbytes;
+    double lagsec;
+    size_t len = 0, used;
+    ssize_t n;
+    int logfd, ifd = -1, pollms = 0, report = REPORT_DEF, ch;
+
+    while((ch = getopt(argc,argv,"s:p:r:n"))!=-1){
+        switch(ch){
+        case 's': opt.nshard = atoi(optarg); break;
+        case 'p': pollms = atoi(optarg); break;
+        case 'r': report = atoi(optarg); break;
+        case 'n': opt.flags |= DB_NOLOCK; break;   //回放期间没有读者
+        default: usage();
+        }
+    }
+    if(optind!=argc-2 || pollms<0 || report<=0) usage();
+
+    //主库还没有启动时日志可能不存在，先创建一个空文件等待
+    if((logfd = open(argv[optind],O_RDONLY|O_CREAT,FILE_MODE))<0) err_sys("can't open change log %s",argv[optind]);
+    if((db = db_open_opt(argv[optind+1],O_RDWR|O_CREAT,FILE_MODE,&opt))==NULL)
+        err_sys("can't open replica %s",argv[optind+1]);
+
+    snprintf(path,sizeof(path),"%s.pos",argv[optind+1]);
+    if((posfd = open(path,O_RDWR|O_CREAT,FILE_MODE))<0) err_sys("can't open %s",path);
+    if(write_lock(posfd,0,SEEK_SET,0)<0) err_quit("another follower is applying to %s",argv[optind+1]);
+    if((n = pread(posfd,line,POSLINE_SZ,0))<0) err_sys("can't read %s",path);
+    line[n] = 0;
+    applied = n>0 ? atoll(line) : 0;
+
+    //不用inotify时轮询
+    if(pollms==0){
+        if((ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC))<0 || inotify_add_watch(ifd,argv[optind],IN_MODIFY)<0)
+            err_sys("inotify error, use -p to poll instead");
+    }
+
+    sa.sa_handler = sig_quit;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
+
+    if((buf = malloc(BUF_SZ+1))==NULL) err_sys("malloc error");
+    log_msg("following %s from offset %lld into %s",argv[optind],(long long)applied,argv[optind+1]);
+    lastreport = now_usec();
+
+    while(!quitflag){
+        //buf中保存着从applied开始、还没有回放的len个字节
+        if((n = pread(logfd,buf+len,BUF_SZ-len,applied+len))<0) log_sys("change log read error");
+        if(n>0){
+            len += n;
+            buf[len] = 0;
+            used = apply(buf,len);
+            applied += used;
+            len -= used;
+            memmove(buf,buf+used,len);
+        }
+        if(fstat(logfd,&statbuff)<0) log_sys("fstat error");
+        if(statbuff.st_size<applied+len)
+            log_quit("change log shrank to %lld bytes, below position %lld",(long long)statbuff.st_size,(long long)applied);
+        savepos(statbuff.st_size);
+
+        if(now_usec()-lastreport>=report*1000000LL){
+            lag(statbuff.st_size,&lagbytes,&lagsec);
+            log_msg("applied %lu records (%lu failed), offset %lld, lag %lld bytes %.3f s",
+              napplied,nfailed,(long long)applied,lagbytes,lagsec);
+            lastreport = now_usec();
+        }
+        //还有没读完的数据时继续读，否则等待日志增长
+        if(statbuff.st_size>applied+len) continue;
+        if(ifd>=0){
+            pfd.fd = ifd;
+            pfd.events = POLLIN;
+            if(poll(&pfd,1,report*1000)>0){
+                char ev[4096];
+                while(read(ifd,ev,sizeof(ev))>0) ;
+            }
+        }else{
+            poll(NULL,0,pollms);
+        }
+    }
+
+    if(fstat(logfd,&statbuff)==0) savepos(statbuff.st_size);
+    log_msg("applied %lu records (%lu failed), stopped at offset %lld",napplied,nfailed,(long long)applied);
+    db_close(db);
+    return 0;
+}
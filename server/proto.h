@@ -0,0 +1,42 @@
+#ifndef _PROTO_H
+#define _PROTO_H
+
+/*
+ * simpledb-server wire protocol.
+ *
+ * Every request and response is one frame; all integers are big-endian.
+ *
+ *   | u32 len | body (len bytes) |
+ *
+ * Request body:   | u8 op | payload |
+ *   OP_GET   u16 klen, key
+ *   OP_SET   u8 flag (DB_INSERT/DB_REPLACE/DB_STORE), u16 klen, key, u32 vlen, value
+ *   OP_DEL   u16 klen, key
+ *   OP_MGET  u16 nkeys, nkeys * (u16 klen, key)
+ *
+ * Response body:  | u8 status | payload |
+ *   OP_GET   value (rest of the frame) when status is ST_OK
+ *   OP_SET   empty
+ *   OP_DEL   empty
+ *   OP_MGET  u16 nkeys, nkeys * (u8 status, u32 vlen, value)
+ *
+ * A client may send any number of requests without waiting;
+ * responses come back in request order on the same connection.
+ */
+
+#define OP_GET		1
+#define OP_SET		2
+#define OP_DEL		3
+#define OP_MGET		4
+
+#define ST_OK		0	/* success */
+#define ST_NOTFOUND	1	/* key does not exist */
+#define ST_EXISTS	2	/* DB_INSERT of an existing key */
+#define ST_INVALID	3	/* malformed request or bad key/value */
+#define ST_ERROR	4	/* any other failure */
+
+#define FRAME_HDR	4	/* u32 length prefix */
+#define FRAME_MAX	(1 << 20)	/* largest frame body accepted */
+#define MGET_MAX	1024	/* max keys in one OP_MGET */
+
+#endif /* _PROTO_H */
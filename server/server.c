@@ -0,0 +1,579 @@
+#include "apue.h"
+#include "db.h"
+#include "proto.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * simpledb-server：由一个进程持有数据库句柄，通过Unix域套接字或者本机TCP对外提供GET/SET/DEL/MGET。
+ * 所有客户端共享同一个句柄(以及它的页缓存)，写操作在进程内用每个分片一把的互斥锁协调，
+ * 不再需要每个客户端进程各自通过fcntl记录锁竞争。
+ * fcntl记录锁属于进程，本来就不能协调同一进程内的线程，线程之间完全靠分片互斥锁；
+ * 默认仍然加记录锁，以便其他进程可以同时以db_open打开同一个库。
+ * 确定服务器是库的唯一使用者时用-n以DB_NOLOCK打开，每次请求省去两到三次fcntl系统调用，
+ * 此时其他进程不能再打开这个库，否则会破坏数据。
+ *
+ * 主线程运行epoll事件循环，连接以EPOLLONESHOT方式注册，
+ * 可读时把连接放入任务队列，由工作线程读取并处理其中所有完整的请求(支持流水线)，
+ * 处理完毕后再重新注册，因此同一个连接在同一时刻只会被一个工作线程处理，响应顺序与请求顺序一致。
+ * 客户端只发不收时，未发送的响应超过OUT_HIWAT后连接暂停读取和处理，直到响应发送出去，
+ * 输入缓冲区也不超过IN_MAX，因此每个连接占用的内存是有界的。
+ *
+ * -m mtf|transpose和-R不是崩溃安全的(见db.c中_db_movehit前的说明)，默认关闭。
+ */
+
+#define NWORKER_DEF	   4	/* default worker threads */
+#define MAXEVENTS	  64	/* events per epoll_wait */
+#define BUF_INIT	4096	/* initial connection buffer size */
+#define IN_MAX		(2 * FRAME_MAX)	/* max input buffer, holds at least one whole frame */
+#define OUT_HIWAT	(256 * 1024)	/* stop reading and processing above this much unsent output */
+
+int log_to_stderr = 1;  //apue的log_*函数使用，daemonize之后改为写syslog
+
+//一个客户端连接
+typedef struct conn{
+    int          fd;
+    char        *in;        //输入缓冲区，保存还没有处理的请求
+    size_t       inlen;
+    size_t       inmax;
+    char        *out;       //输出缓冲区，保存还没有发送的响应
+    size_t       outlen;
+    size_t       outmax;
+    size_t       outsent;   //out中已经发送的字节数
+    int          eof;       //对端已经关闭写端，发送完剩余的响应后关闭连接
+    struct conn *next;      //任务队列中的下一个连接
+}CONN;
+
+static DBHANDLE         db;
+static pthread_mutex_t *shardlock;  //每个分片一把锁，DBHANDLE本身不是线程安全的
+static int              nshard;
+static int              epfd;
+
+//任务队列
+static CONN            *qhead, *qtail;
+static pthread_mutex_t  qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   qready = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t quitflag;
+
+//后台重排哈希链表的线程
+static int              reorder_secs;   //间隔秒数，0表示不启动
+static pthread_mutex_t  rlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   rwake = PTHREAD_COND_INITIALIZER;
+
+static void     conn_arm(CONN *, int);
+static int      conn_busy(CONN *);
+static void     conn_free(CONN *);
+static int      conn_flush(CONN *);
+static void     conn_handle(CONN *);
+static int      conn_read(CONN *);
+static void     do_request(CONN *, const unsigned char *, size_t);
+static void     out_reserve(CONN *, size_t);
+static void     out_u8(CONN *, unsigned int);
+static void     out_u16(CONN *, unsigned int);
+static void     out_u32(CONN *, unsigned long);
+static void     out_bytes(CONN *, const void *, size_t);
+static int      get_key(const unsigned char **, const unsigned char *, char *);
+static int      tcp_listen(int);
+static void    *worker(void *);
+static void    *reorderer(void *);
+
+static void sig_quit(int signo){
+    quitflag = 1;
+}
+
+static unsigned int get_u16(const unsigned char *p){
+    return (p[0]<<8) | p[1];
+}
+
+static unsigned long get_u32(const unsigned char *p){
+    return ((unsigned long)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+//保证输出缓冲区中还有n个字节的空间
+static void out_reserve(CONN *c, size_t n){
+    if(c->outlen+n<=c->outmax) return;
+    while(c->outlen+n>c->outmax) c->outmax *= 2;
+    if((c->out = realloc(c->out,c->outmax))==NULL) err_sys("realloc error");
+}
+
+static void out_u8(CONN *c, unsigned int v){
+    out_reserve(c,1);
+    c->out[c->outlen++] = v;
+}
+
+static void out_u16(CONN *c, unsigned int v){
+    out_reserve(c,2);
+    c->out[c->outlen++] = v>>8;
+    c->out[c->outlen++] = v;
+}
+
+static void out_u32(CONN *c, unsigned long v){
+    out_reserve(c,4);
+    c->out[c->outlen++] = v>>24;
+    c->out[c->outlen++] = v>>16;
+    c->out[c->outlen++] = v>>8;
+    c->out[c->outlen++] = v;
+}
+
+static void out_bytes(CONN *c, const void *p, size_t n){
+    out_reserve(c,n);
+    memcpy(c->out+c->outlen,p,n);
+    c->outlen += n;
+}
+
+//从*pp处解析一个 u16 klen, key，拷贝到以\0结尾的key中，格式错误返回-1
+static int get_key(const unsigned char **pp, const unsigned char *end, char *key){
+    const unsigned char *p = *pp;
+    unsigned int klen;
+
+    if(end-p<2) return -1;
+    klen = get_u16(p);
+    p += 2;
+    if(klen==0 || klen>IDXLEN_MAX || end-p<klen || memchr(p,0,klen)!=NULL) return -1;
+    memcpy(key,p,klen);
+    key[klen] = 0;
+    *pp = p+klen;
+    return 0;
+}
+
+//将db_store/db_delete的errno转换为响应状态
+static int errno_status(int err){
+    switch(err){
+    case ENOENT: return ST_NOTFOUND;
+    case EEXIST: return ST_EXISTS;
+    case EINVAL: return ST_INVALID;
+    default:     return ST_ERROR;
+    }
+}
+
+//在持有分片锁的情况下读取一个键，找到时把值追加到输出缓冲区
+//db_fetch返回的是分片内部的缓冲区，必须在解锁之前拷贝出来
+static int fetch_locked(CONN *c, const char *key, int withlen){
+    pthread_mutex_t *lk = &shardlock[db_keyshard(db,key)];
+    char *val;
+    size_t vlen;
+
+    pthread_mutex_lock(lk);
+    if((val = db_fetch(db,key))==NULL){
+        pthread_mutex_unlock(lk);
+        return ST_NOTFOUND;
+    }
+    vlen = strlen(val);
+    if(withlen){
+        out_u8(c,ST_OK);
+        out_u32(c,vlen);
+    }
+    out_bytes(c,val,vlen);
+    pthread_mutex_unlock(lk);
+    return ST_OK;
+}
+
+//处理一个请求(body为帧的内容)，并把响应帧追加到输出缓冲区
+static void do_request(CONN *c, const unsigned char *body, size_t len){
+    const unsigned char *p = body+1, *end = body+len;
+    char key[IDXLEN_MAX+1], val[DATLEN_MAX+1];
+    pthread_mutex_t *lk;
+    size_t hdr, vlen;
+    unsigned int i, n, flag;
+    int st, rc;
+
+    //先占住长度字段，最后再回填
+    out_reserve(c,FRAME_HDR);
+    hdr = c->outlen;
+    c->outlen += FRAME_HDR;
+
+    if(len<1) goto invalid;
+    switch(body[0]){
+    case OP_GET:
+        if(get_key(&p,end,key)<0 || p!=end) goto invalid;
+        out_reserve(c,1);
+        c->outlen++;    //状态在读取之后才知道
+        if((st = fetch_locked(c,key,0))!=ST_OK) c->outlen = hdr+FRAME_HDR+1;
+        c->out[hdr+FRAME_HDR] = st;
+        break;
+
+    case OP_SET:
+        if(end-p<1) goto invalid;
+        flag = *p++;
+        if(get_key(&p,end,key)<0 || end-p<4) goto invalid;
+        vlen = get_u32(p);
+        p += 4;
+        if(vlen>=DATLEN_MAX || end-p!=vlen || memchr(p,0,vlen)!=NULL) goto invalid;
+        memcpy(val,p,vlen);
+        val[vlen] = 0;
+        lk = &shardlock[db_keyshard(db,key)];
+        pthread_mutex_lock(lk);
+        rc = db_store(db,key,val,flag);
+        st = rc<0 ? errno_status(errno) : ST_OK;
+        pthread_mutex_unlock(lk);
+        out_u8(c,st);
+        break;
+
+    case OP_DEL:
+        if(get_key(&p,end,key)<0 || p!=end) goto invalid;
+        lk = &shardlock[db_keyshard(db,key)];
+        pthread_mutex_lock(lk);
+        rc = db_delete(db,key);
+        pthread_mutex_unlock(lk);
+        out_u8(c,rc<0 ? ST_NOTFOUND : ST_OK);
+        break;
+
+    case OP_MGET:
+        if(end-p<2 || (n = get_u16(p))>MGET_MAX) goto invalid;
+        p += 2;
+        //先检查整个请求的格式，避免输出了一半的结果
+        {
+            const unsigned char *q = p;
+            for(i=0;i<n;i++){
+                if(get_key(&q,end,key)<0) goto invalid;
+            }
+            if(q!=end) goto invalid;
+        }
+        out_u8(c,ST_OK);
+        out_u16(c,n);
+        for(i=0;i<n;i++){
+            get_key(&p,end,key);
+            if(fetch_locked(c,key,1)!=ST_OK){
+                out_u8(c,ST_NOTFOUND);
+                out_u32(c,0);
+            }
+        }
+        break;
+
+    default:
+        goto invalid;
+    }
+    goto done;
+
+invalid:
+    c->outlen = hdr+FRAME_HDR;
+    out_u8(c,ST_INVALID);
+
+done:
+    len = c->outlen-hdr-FRAME_HDR;
+    c->out[hdr]   = len>>24;
+    c->out[hdr+1] = len>>16;
+    c->out[hdr+2] = len>>8;
+    c->out[hdr+3] = len;
+}
+
+//未发送的响应太多，暂时不再读取和处理新的请求
+static int conn_busy(CONN *c){
+    return c->outlen-c->outsent>OUT_HIWAT;
+}
+
+//读取连接上所有可读的数据(最多读满IN_MAX)，对端关闭或者出错返回-1
+static int conn_read(CONN *c){
+    ssize_t n;
+
+    for(;;){
+        if(c->inlen==c->inmax){
+            if(c->inmax>=IN_MAX) return 0;  //剩下的数据留在套接字中，处理完已有的请求后再读
+            c->inmax *= 2;
+            if((c->in = realloc(c->in,c->inmax))==NULL) err_sys("realloc error");
+        }
+        n = read(c->fd,c->in+c->inlen,c->inmax-c->inlen);
+        if(n>0){
+            c->inlen += n;
+        }else if(n==0){
+            return -1;
+        }else if(errno==EAGAIN || errno==EWOULDBLOCK){
+            return 0;
+        }else if(errno!=EINTR){
+            return -1;
+        }
+    }
+}
+
+//发送输出缓冲区，全部发送完返回0，套接字缓冲区满返回1，出错返回-1
+static int conn_flush(CONN *c){
+    ssize_t n;
+
+    while(c->outsent<c->outlen){
+        n = write(c->fd,c->out+c->outsent,c->outlen-c->outsent);
+        if(n>0){
+            c->outsent += n;
+        }else if(n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+            return 1;
+        }else if(n<0 && errno==EINTR){
+            continue;
+        }else{
+            return -1;
+        }
+    }
+    c->outlen = c->outsent = 0;
+    return 0;
+}
+
+//重新向epoll注册连接，wantout表示还有没发送完的响应
+//输出积压或者输入缓冲区已满时不关心可读事件，否则会在发送完成之前反复被唤醒
+static void conn_arm(CONN *c, int wantout){
+    struct epoll_event ev;
+    int wantin;
+
+    wantin = !c->eof && !conn_busy(c) && c->inlen<IN_MAX;
+    ev.events = EPOLLONESHOT | (wantin ? EPOLLIN | EPOLLRDHUP : 0) | (wantout ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if(epoll_ctl(epfd,EPOLL_CTL_MOD,c->fd,&ev)<0) err_sys("epoll_ctl error");
+}
+
+static void conn_free(CONN *c){
+    close(c->fd);   //关闭后fd自动从epoll中移除
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+//工作线程处理一个就绪的连接：读取、处理所有完整的请求、发送响应
+//输出积压时暂停处理，发送出去之后继续处理缓冲区中剩下的请求
+static void conn_handle(CONN *c){
+    size_t off, len;
+    int rc;
+
+    do{
+        if(!c->eof && !conn_busy(c) && conn_read(c)<0) c->eof = 1;
+
+        //依次处理缓冲区中所有完整的帧，不完整的帧留到下次
+        off = 0;
+        while(c->inlen-off>=FRAME_HDR && !conn_busy(c)){
+            len = get_u32((unsigned char *)c->in+off);
+            if(len>FRAME_MAX){
+                //无法恢复的协议错误，丢弃所有输入
+                c->eof = 1;
+                off = c->inlen;
+                break;
+            }
+            if(c->inlen-off-FRAME_HDR<len) break;
+            do_request(c,(unsigned char *)c->in+off+FRAME_HDR,len);
+            off += FRAME_HDR+len;
+        }
+        if(off>0){
+            memmove(c->in,c->in+off,c->inlen-off);
+            c->inlen -= off;
+        }
+
+        rc = conn_flush(c);
+    }while(rc==0 && c->inlen>=FRAME_HDR && c->inlen-FRAME_HDR>=get_u32((unsigned char *)c->in));
+
+    if(rc<0 || (c->eof && rc==0)){
+        conn_free(c);
+        return;
+    }
+    conn_arm(c,rc==1);
+}
+
+static void *worker(void *arg){
+    CONN *c;
+
+    for(;;){
+        pthread_mutex_lock(&qlock);
+        while(qhead==NULL && !quitflag) pthread_cond_wait(&qready,&qlock);
+        if(qhead==NULL){
+            pthread_mutex_unlock(&qlock);
+            return NULL;
+        }
+        c = qhead;
+        if((qhead = c->next)==NULL) qtail = NULL;
+        pthread_mutex_unlock(&qlock);
+
+        conn_handle(c);
+    }
+}
+
+//每隔reorder_secs秒按命中次数重写各分片的哈希链表，每次只持有一个分片的锁
+static void *reorderer(void *arg){
+    struct timespec ts;
+    DBSTAT st;
+    int i, n;
+
+    pthread_mutex_lock(&rlock);
+    while(!quitflag){
+        clock_gettime(CLOCK_REALTIME,&ts);
+        ts.tv_sec += reorder_secs;
+        pthread_cond_timedwait(&rwake,&rlock,&ts);
+        if(quitflag) break;
+
+        for(i=0,n=0;i<nshard;i++){
+            pthread_mutex_lock(&shardlock[i]);
+            n += db_reorder(db,i);
+            pthread_mutex_unlock(&shardlock[i]);
+        }
+        //计数器分布在各个分片中，按顺序锁住所有分片再读取(工作线程每次只持有一把分片锁，不会死锁)
+        for(i=0;i<nshard;i++) pthread_mutex_lock(&shardlock[i]);
+        db_stats(db,&st);
+        for(i=nshard-1;i>=0;i--) pthread_mutex_unlock(&shardlock[i]);
+        log_msg("reordered %d chains, %.2f hops/fetch, %lu moves",n,
+          st.fetchok+st.fetcherr>0 ? (double)st.fetchhops/(st.fetchok+st.fetcherr) : 0.0,st.moves);
+    }
+    pthread_mutex_unlock(&rlock);
+    return NULL;
+}
+
+//在127.0.0.1:port上监听
+static int tcp_listen(int port){
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    if((fd = socket(AF_INET,SOCK_STREAM,0))<0) return -1;
+    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd,(struct sockaddr *)&addr,sizeof(addr))<0 || listen(fd,SOMAXCONN)<0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(void){
+    err_quit("usage: simpledb-server [-d] [-u socket | -p port] [-t nthreads] "
+      "[-s nshard] [-e hash|log] [-l changelog] [-m count|mtf|transpose] [-R secs] [-n] dbname");
+}
+
+int main(int argc, char *argv[]){
+    const char *sockpath = "/tmp/simpledb.sock";
+    int port = 0, nworker = NWORKER_DEF, daemonflag = 0;
+    DBOPT opt = {0, DB_ENGINE_AUTO};
+    DBSTAT st;
+    struct epoll_event ev, events[MAXEVENTS];
+    struct sigaction sa;
+    sigset_t mask, oldmask;
+    pthread_t *tids, rtid;
+    CONN *c;
+    int listenfd, fd, n, i, ch, on = 1;
+
+    while((ch = getopt(argc,argv,"du:p:t:s:e:l:m:R:n"))!=-1){
+        switch(ch){
+        case 'd': daemonflag = 1; break;
+        case 'u': sockpath = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 't': nworker = atoi(optarg); break;
+        case 's': opt.nshard = atoi(optarg); break;
+        case 'e':
+            if(strcmp(optarg,"hash")==0) opt.engine = DB_ENGINE_HASH;
+            else if(strcmp(optarg,"log")==0) opt.engine = DB_ENGINE_LOG;
+            else usage();
+            break;
+        case 'l': opt.changelog = optarg; break;  //供simpledb-follower回放
+        case 'm':
+            if(strcmp(optarg,"mtf")==0) opt.flags |= DB_MTF;
+            else if(strcmp(optarg,"transpose")==0) opt.flags |= DB_TRANSPOSE;
+            else if(strcmp(optarg,"count")==0) opt.flags |= DB_REORDER;
+            else usage();
+            break;
+        case 'R':
+            reorder_secs = atoi(optarg);
+            opt.flags |= DB_REORDER;
+            break;
+        case 'n': opt.flags |= DB_NOLOCK; break;  //服务器是唯一的使用者
+        default: usage();
+        }
+    }
+    if(optind!=argc-1 || nworker<=0 || reorder_secs<0) usage();
+
+    if(daemonflag){
+        daemonize("simpledb-server");   //会切换到根目录，因此数据库和套接字路径应为绝对路径
+        log_to_stderr = 0;
+    }
+
+    if((db = db_open_opt(argv[optind],O_RDWR|O_CREAT,FILE_MODE,&opt))==NULL)
+        log_sys("can't open database %s",argv[optind]);
+    db_stats(db,&st);
+    nshard = st.nshard;
+    if((shardlock = malloc(nshard*sizeof(pthread_mutex_t)))==NULL) log_sys("malloc error");
+    for(i=0;i<nshard;i++) pthread_mutex_init(&shardlock[i],NULL);
+
+    if(port>0){
+        if((listenfd = tcp_listen(port))<0) log_sys("can't listen on port %d",port);
+    }else{
+        if((listenfd = serv_listen(sockpath))<0) log_sys("can't listen on %s",sockpath);
+    }
+    set_fl(listenfd,O_NONBLOCK);
+
+    //SIGINT/SIGTERM让epoll_wait返回EINTR，随后正常关闭数据库
+    sa.sa_handler = sig_quit;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
+    signal(SIGPIPE,SIG_IGN);
+
+    if((epfd = epoll_create(MAXEVENTS))<0) log_sys("epoll_create error");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;     //data.ptr为NULL表示监听套接字
+    if(epoll_ctl(epfd,EPOLL_CTL_ADD,listenfd,&ev)<0) log_sys("epoll_ctl error");
+
+    //工作线程屏蔽SIGINT/SIGTERM，保证信号一定打断主线程的epoll_wait
+    sigemptyset(&mask);
+    sigaddset(&mask,SIGINT);
+    sigaddset(&mask,SIGTERM);
+    pthread_sigmask(SIG_BLOCK,&mask,&oldmask);
+    if((tids = malloc(nworker*sizeof(pthread_t)))==NULL) log_sys("malloc error");
+    for(i=0;i<nworker;i++){
+        if(pthread_create(&tids[i],NULL,worker,NULL)!=0) log_quit("pthread_create error");
+    }
+    if(reorder_secs>0 && pthread_create(&rtid,NULL,reorderer,NULL)!=0) log_quit("pthread_create error");
+    pthread_sigmask(SIG_SETMASK,&oldmask,NULL);
+    if(port>0) log_msg("serving %s (%d shards) on 127.0.0.1:%d, %d workers",argv[optind],st.nshard,port,nworker);
+    else log_msg("serving %s (%d shards) on %s, %d workers",argv[optind],st.nshard,sockpath,nworker);
+
+    while(!quitflag){
+        if((n = epoll_wait(epfd,events,MAXEVENTS,-1))<0){
+            if(errno==EINTR) continue;
+            log_sys("epoll_wait error");
+        }
+        for(i=0;i<n;i++){
+            if(events[i].data.ptr==NULL){
+                //接受所有等待中的连接
+                while((fd = accept(listenfd,NULL,NULL))>=0){
+                    set_fl(fd,O_NONBLOCK);
+                    if(port>0) setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+                    if((c = calloc(1,sizeof(CONN)))==NULL) log_sys("calloc error");
+                    c->fd = fd;
+                    c->inmax = c->outmax = BUF_INIT;
+                    if((c->in = malloc(BUF_INIT))==NULL || (c->out = malloc(BUF_INIT))==NULL)
+                        log_sys("malloc error");
+                    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                    ev.data.ptr = c;
+                    if(epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)<0) log_sys("epoll_ctl error");
+                }
+                continue;
+            }
+            //交给工作线程处理
+            c = events[i].data.ptr;
+            c->next = NULL;
+            pthread_mutex_lock(&qlock);
+            if(qtail==NULL) qhead = c;
+            else qtail->next = c;
+            qtail = c;
+            pthread_cond_signal(&qready);
+            pthread_mutex_unlock(&qlock);
+        }
+    }
+
+    //通知工作线程处理完队列后退出，然后关闭数据库
+    pthread_mutex_lock(&qlock);
+    pthread_cond_broadcast(&qready);
+    pthread_mutex_unlock(&qlock);
+    for(i=0;i<nworker;i++) pthread_join(tids[i],NULL);
+    if(reorder_secs>0){
+        pthread_mutex_lock(&rlock);
+        pthread_cond_broadcast(&rwake);
+        pthread_mutex_unlock(&rlock);
+        pthread_join(rtid,NULL);
+    }
+    db_close(db);
+    if(port==0) unlink(sockpath);
+    log_msg("shut down");
+    exit(0);
+}
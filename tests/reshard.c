@@ -0,0 +1,95 @@
+#include "apue.h"
+#include "db.h"
+
+#include <fcntl.h>
+#include <errno.h>
+
+/*
+ * 以不同的分片数重新打开已有的数据库：
+ * 不带O_TRUNC时必须返回EINVAL，带O_TRUNC时删除原来的分片并按新的分片数创建。
+ */
+
+static int nfail;
+
+#define CHECK(cond) do{ \
+        if(!(cond)){ \
+            fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+            nfail++; \
+        } \
+    }while(0)
+
+//打开pathname并写入nkey条记录，返回实际的分片数
+static int fill(const char *pathname, int nshard, int engine, int nkey){
+    DBOPT opt = {nshard, engine, 0, NULL};
+    DBHANDLE db;
+    DBSTAT st;
+    char key[32];
+    int i;
+
+    if((db = db_open_opt(pathname,O_RDWR|O_CREAT|O_TRUNC,FILE_MODE,&opt))==NULL){
+        fprintf(stderr,"can't create %s with %d shards: %s\n",pathname,nshard,strerror(errno));
+        nfail++;
+        return -1;
+    }
+    for(i=0;i<nkey;i++){
+        sprintf(key,"key%d",i);
+        CHECK(db_store(db,key,"value",DB_STORE)>=0);
+    }
+    db_stats(db,&st);
+    db_close(db);
+    return st.nshard;
+}
+
+//以自动探测的分片数打开，返回分片数和记录数
+static int count(const char *pathname, int *nrec){
+    DBHANDLE db;
+    DBSTAT st;
+
+    *nrec = -1;
+    if((db = db_open(pathname,O_RDONLY))==NULL) return -1;
+    for(*nrec=0;db_nextrec(db,NULL)!=NULL;(*nrec)++) ;
+    db_stats(db,&st);
+    db_close(db);
+    return st.nshard;
+}
+
+static void reshard(int engine){
+    const char *name = engine==DB_ENGINE_LOG ? "reshard_log" : "reshard_hash";
+    DBOPT opt = {2, engine, 0, NULL};
+    char path[64];
+    int nrec;
+
+    CHECK(fill(name,4,engine,100)==4);
+
+    //不截断时分片数必须一致
+    errno = 0;
+    CHECK(db_open_opt(name,O_RDWR|O_CREAT,FILE_MODE,&opt)==NULL && errno==EINVAL);
+    CHECK(count(name,&nrec)==4 && nrec==100);
+
+    //截断时按新的分片数重新创建，原来的分片文件都被删除
+    CHECK(fill(name,2,engine,10)==2);
+    CHECK(count(name,&nrec)==2 && nrec==10);
+    snprintf(path,sizeof(path),engine==DB_ENGINE_LOG ? "%s.3.lck" : "%s.3.idx",name);
+    CHECK(access(path,F_OK)<0);
+
+    //从多个分片变回一个分片(不带序号的文件名)
+    CHECK(fill(name,1,engine,5)==1);
+    CHECK(count(name,&nrec)==1 && nrec==5);
+    snprintf(path,sizeof(path),engine==DB_ENGINE_LOG ? "%s.0.lck" : "%s.0.idx",name);
+    CHECK(access(path,F_OK)<0);
+
+    //再从一个分片变回多个分片，不带序号的旧文件不能再被探测到
+    CHECK(fill(name,3,engine,7)==3);
+    CHECK(count(name,&nrec)==3 && nrec==7);
+}
+
+int main(void){
+    reshard(DB_ENGINE_HASH);
+    reshard(DB_ENGINE_LOG);
+    if(nfail>0){
+        fprintf(stderr,"%d checks failed\n",nfail);
+        return 1;
+    }
+    printf("reshard ok\n");
+    return 0;
+}